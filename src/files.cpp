@@ -22,6 +22,10 @@
 
 #include <iostream>
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 
 static string numlocale   = "";
 static string colllocale  = "";
@@ -43,31 +47,6 @@ void reset_locales() {
 }
 
 
-static float read_float(ifstream &file) {
-	// Read platform independent 32 bit ieee 754 little-endian float.
-	union ieee_union {
-		char buffer[4];
-		struct ieee_struct {
-			unsigned int mantissa:23;
-			unsigned int exponent:8;
-			unsigned int negative:1;
-		} ieee;
-	} ieee;
-	file.read (ieee.buffer, 4);
-
-	GFloatIEEE754 ret;
-	ret.mpn.mantissa = ieee.ieee.mantissa;
-	ret.mpn.biased_exponent = ieee.ieee.exponent;
-	ret.mpn.sign = ieee.ieee.negative;
-
-	return ret.v_float;
-}
-
-static double read_double(ifstream &file) {
-  return double(read_float(file));
-}
-
-
 File::File(Glib::RefPtr<Gio::File> file)
  : _file(file)
 {
@@ -75,9 +54,20 @@ File::File(Glib::RefPtr<Gio::File> file)
   _type = getFileType(_path);
 }
 
-void File::loadTriangles(vector< vector<Triangle> > &triangles,
-			 vector<ustring> &names,
-			 uint max_triangles)
+// one mesh per shape
+static void make_meshes(vector< vector<Triangle> > &triangles,
+			vector<Mesh> &meshes)
+{
+  meshes.resize(triangles.size());
+  for (uint i = 0; i < triangles.size(); i++) {
+    meshes[i].setTriangles(triangles[i]);
+    vector<Triangle>().swap(triangles[i]);
+  }
+}
+
+void File::loadMeshes(vector<Mesh> &meshes,
+		      vector<ustring> &names,
+		      uint max_triangles)
 {
   Gio::FileType type = _file->query_file_type();
   if (type != Gio::FILE_TYPE_REGULAR &&
@@ -89,6 +79,7 @@ void File::loadTriangles(vector< vector<Triangle> > &triangles,
   name_by_file = (ustring)name_by_file.substr(0,found);
 
   set_locales("C");
+  vector< vector<Triangle> > triangles;
   if(_type == ASCII_STL) {
     // multiple shapes per file
     load_asciiSTL(triangles, names, max_triangles);
@@ -96,23 +87,27 @@ void File::loadTriangles(vector< vector<Triangle> > &triangles,
       names[0] = name_by_file;
     if (triangles.size() == 0) {// if no success, try binary mode
       _type = BINARY_STL;
-      loadTriangles(triangles, names, max_triangles);
+      loadMeshes(meshes, names, max_triangles);
       return;
     }
+    make_meshes(triangles, meshes);
   } else if (_type == AMF) {
     // multiple shapes per file
     load_AMF(triangles, names, max_triangles);
     if (names.size() == 1) // if single shape name by file
       names[0] = name_by_file;
+    make_meshes(triangles, meshes);
   } else {
     // single shape per file
-    triangles.resize(1);
+    meshes.resize(1);
     names.resize(1);
     names[0] = name_by_file;
     if (_type == BINARY_STL) {
-      load_binarySTL(triangles[0], max_triangles);
+      load_binarySTL(meshes[0], max_triangles);
     } else if (_type == VRML) {
+      triangles.resize(1);
       load_VRML(triangles[0], max_triangles);
+      make_meshes(triangles, meshes);
     } else {
       cerr << _("Unrecognized file - ") << _file->get_parse_name() << endl;
       cerr << _("Known extensions: ") << "STL, WRL, AMF." << endl;
@@ -173,83 +168,92 @@ filetype_t File::getFileType(ustring filename)
 }
 
 
-bool File::load_binarySTL(vector<Triangle> &triangles,
+// platform independent 32 bit little-endian values from a byte buffer
+static inline guint32 get_uint32(const char *p) {
+  guint32 v;
+  memcpy(&v, p, 4);
+  return GUINT32_FROM_LE(v);
+}
+static inline double get_float(const char *p) {
+  const guint32 v = get_uint32(p);
+  float f;
+  memcpy(&f, &v, 4);
+  return double(f);
+}
+static inline Vector3d get_vector(const char *p) {
+  return Vector3d(get_float(p), get_float(p+4), get_float(p+8));
+}
+
+bool File::load_binarySTL(Mesh &mesh,
 			  uint max_triangles, bool readnormals)
 {
-    ifstream file;
-    ustring filename = _file->get_path();
-    file.open(filename.c_str(), ifstream::in | ifstream::binary);
-
-    if(file.fail()) {
-      cerr << _("Error: Unable to open stl file - ") << filename << endl;
-      return false;
+  ustring filename = _file->get_path();
+  GError *error = NULL;
+  GMappedFile *mapped = g_mapped_file_new(filename.c_str(), FALSE, &error);
+  if (mapped == NULL) {
+    cerr << _("Error: Unable to open stl file - ") << filename;
+    if (error) {
+      cerr << ": " << error->message;
+      g_error_free(error);
     }
-    // cerr << "loading bin " << filename << endl;
+    cerr << endl;
+    return false;
+  }
+  const char *data = g_mapped_file_get_contents(mapped);
+  const size_t size = g_mapped_file_get_length(mapped);
+  vector<Vector3d> corners;
+  bool ok = parseSTLtriangles_binary(data, size, max_triangles, readnormals,
+				     corners);
+  g_mapped_file_unref(mapped);
+  if (ok)
+    mesh.setCorners(corners);
+  else
+    cerr << _("Error: Unable to read binary stl file - ") << filename << endl;
+  return ok;
+}
 
-    /* Binary STL files have a meaningless 80 byte header
-     * followed by the number of triangles */
-    file.seekg(80, ios_base::beg);
-    unsigned int num_triangles;
-    unsigned char buffer[4];
-    file.read(reinterpret_cast <char *> (buffer), 4);
-    // Read platform independent 32-bit little-endian int.
-    num_triangles = buffer[0] | buffer[1] << 8 | buffer[2] << 16 | buffer[3] << 24;
+bool File::parseSTLtriangles_binary(const char *data, size_t size,
+				    uint max_triangles, bool readnormals,
+				    vector<Vector3d> &corners)
+{
+  /* Binary STL files have a meaningless 80 byte header
+   * followed by the number of triangles and 50 bytes per triangle:
+   * normal, 3 vertices and a 2 byte attribute */
+  if (data == NULL || size < 84)
+    return false;
+  const size_t in_file = (size - 84) / 50;
+  uint num_triangles = get_uint32(data + 80);
+  if (num_triangles != in_file) {
+    cerr << _("Binary STL header says ") << num_triangles
+	 << _(" triangles, file size allows ") << in_file << endl;
+    // trust the header unless it points beyond the end of the file
+    if (num_triangles == 0 || num_triangles > in_file)
+      num_triangles = in_file;
+  }
 
-    uint step = 1;
-    if (max_triangles > 0 && max_triangles < num_triangles) {
-      step = ceil(num_triangles/max_triangles);
-      triangles.reserve(max_triangles);
-    } else
-      triangles.reserve(num_triangles);
-
-    uint i = 0;
-    for(; i < num_triangles; i+=step)
-    {
-      if (step>1)
-	file.seekg(84 + 50*i, ios_base::beg);
-
-      double a,b,c;
-        a = read_double (file);
-        b = read_double (file);
-        c = read_double (file);
-        Vector3d N(a,b,c);
-        a = read_double (file);
-        b = read_double (file);
-        c = read_double (file);
-        Vector3d Ax(a,b,c);
-        a = read_double (file);
-        b = read_double (file);
-        c = read_double (file);
-        Vector3d Bx(a,b,c);
-        a = read_double (file);
-        b = read_double (file);
-        c = read_double (file);
-        Vector3d Cx(a,b,c);
-
-        if (file.eof()) {
-            cerr << _("Unexpected EOF reading STL file - ") << filename << endl;
-            break;
-        }
-
-        /* attribute byte count - sometimes contains face color
-            information but is useless for our purposes */
-        unsigned short byte_count;
-        file.read(reinterpret_cast <char *> (buffer), 2);
-	byte_count = buffer[0] | buffer[1] << 8;
-	// Repress unused variable warning.
-	(void)&byte_count;
-
-	Triangle T = Triangle(Ax,Bx,Cx);
-	if (readnormals)
-	  if (T.Normal.dot(N) < 0) T.invertNormal();
-
-	// cout << "bin triangle "<< N << ":\n\t" << Ax << "/\n\t"<<Bx << "/\n\t"<<Cx << endl;
-        triangles.push_back(T);
-    }
-    file.close();
+  uint step = 1;
+  if (max_triangles > 0 && max_triangles < num_triangles)
+    step = (num_triangles + max_triangles - 1) / max_triangles;
+  const int count = (num_triangles + step - 1) / step;
 
-    return true;
-    // cerr << "Read " << i << " triangles of " << num_triangles << " from file" << endl;
+  corners.resize(3 * size_t(count));
+  const char *records = data + 84;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+  for (int i = 0; i < count; i++) {
+    const char *rec = records + 50 * size_t(i) * step;
+    Vector3d *c = &corners[3 * size_t(i)];
+    c[0] = get_vector(rec+12);
+    c[1] = get_vector(rec+24);
+    c[2] = get_vector(rec+36);
+    if (readnormals) {
+      // the winding's normal as in Triangle::calcNormal
+      const Vector3d normal = (c[2]-c[0]).cross(c[2]-c[1]);
+      if (normal.dot(get_vector(rec)) < 0) std::swap(c[0], c[2]);
+    }
+  }
+  return true;
 }
 
 
@@ -258,179 +262,262 @@ bool File::load_asciiSTL(vector< vector<Triangle> > &triangles,
 			 uint max_triangles, bool readnormals)
 {
   ustring filename = _file->get_path();
-  ifstream file;
-  file.open(filename.c_str(), ifstream::in);
-  if(file.fail()) {
-    cerr << _("Error: Unable to open stl file - ") << filename << endl;
+  GError *error = NULL;
+  GMappedFile *mapped = g_mapped_file_new(filename.c_str(), FALSE, &error);
+  if (mapped == NULL) {
+    cerr << _("Error: Unable to open stl file - ") << filename;
+    if (error) {
+      cerr << ": " << error->message;
+      g_error_free(error);
+    }
+    cerr << endl;
     return false;
   }
-  // fileis.imbue(std::locale::classic());
-
   // get as many shapes as found in file
-  while (true) {
-    vector<Triangle> tr;
-    ustring name;
-    if (!File::parseSTLtriangles_ascii(file, max_triangles, readnormals,
-				       tr, name))
-      break;
-
-    triangles.push_back(tr);
-    names.push_back(name);
-    // go back to get "solid " keyword again
-    streampos where = file.tellg();
-    where-=100;
-    if (where < 0) break;
-    file.seekg(where,ios::beg);
-  }
+  parseSTLsolids_ascii(g_mapped_file_get_contents(mapped),
+		       g_mapped_file_get_length(mapped),
+		       max_triangles, readnormals, triangles, names);
+  g_mapped_file_unref(mapped);
+  return true;
+}
 
-  //     if (ret < 0) {// cannot parse, try binary
-  //       cerr << _("Could not read file in ASCII mode, trying Binary: ")<< filename << endl;
-  //       file.close();
-  //       return loadBinarySTL(filename, max_triangles, readnormals);
-  //     }
 
-  file.close();
-  return true;
+// Tokenizer for ASCII STL text in memory, independent of the locale.
+static inline bool is_space(char c) {
+  return c == ' ' || c == '\n' || c == '\r' || c == '\t' || c == '\f' || c == '\v';
 }
 
+// whole word starting at p, not part of a longer token
+static inline bool is_word_at(const char *p, const char *start, const char *end,
+			      const char *word, size_t len) {
+  return size_t(end - p) >= len && memcmp(p, word, len) == 0
+    && (p == start || is_space(p[-1]))
+    && (p + len == end || is_space(p[len]));
+}
 
-bool File::parseSTLtriangles_ascii (istream &text,
-				    uint max_triangles, bool readnormals,
-				    vector<Triangle> &triangles,
-				    ustring &shapename)
+// first occurrence of the whole word in [p, end), or end
+static const char *find_word(const char *p, const char *start, const char *end,
+			     const char *word)
 {
-  //cerr << "loading ascii " << endl;
-  //cerr << " locale " << std::locale().name() << endl;
-
-  shapename = _("Unnamed");
-    // uint step = 1;
-    // if (max_triangles > 0 && max_triangles < num_triangles) {
-    //   step = ceil(num_triangles/max_triangles);
-    streampos pos = text.tellg();
-    text.seekg(0, ios::end);
-    streampos fsize = text.tellg();
-    text.seekg(pos, ios::beg);
+  const size_t len = strlen(word);
+  while (p < end) {
+    p = (const char*)memchr(p, word[0], end - p);
+    if (p == NULL) return end;
+    if (is_word_at(p, start, end, word, len)) return p;
+    p++;
+  }
+  return end;
+}
 
-    // a rough estimation
-    uint num_triangles = (fsize-pos)/30;
+static inline const char *end_of_line(const char *p, const char *end) {
+  const char *eol = (const char*)memchr(p, '\n', end - p);
+  return eol ? eol : end;
+}
 
-    uint step = 1;
-    if (max_triangles > 0 && max_triangles < num_triangles)
-      step = ceil(num_triangles/max_triangles);
-
-    //cerr << "step " << step << endl;
-
-    /* ASCII files start with "solid [Name_of_file]"
-     * so get rid of them to access the data */
-    string solid;
-    //getline (text, solid);
-
-    while(!text.eof()) { // Find next solid
-      text >> solid;
-      if (solid == "solid") {
-	string name;
-	getline(text,name);
-	shapename = (ustring)name;
-	break;
+struct STLTokenizer {
+  const char *p, *end;
+  const char *tok;
+  size_t len;
+  STLTokenizer(const char *begin_, const char *end_)
+    : p(begin_), end(end_), tok(NULL), len(0) {};
+  bool next() {
+    while (p < end && is_space(*p)) p++;
+    tok = p;
+    while (p < end && !is_space(*p)) p++;
+    len = p - tok;
+    return len > 0;
+  };
+  bool is(const char *word) const {
+    return strlen(word) == len && memcmp(tok, word, len) == 0;
+  };
+  bool expect(const char *word) { return next() && is(word); };
+  // correctly rounded like istream >> double
+  bool number(double &d) {
+    if (!next()) return false;
+    static const double pow10[] = { 1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,
+				    1e8,  1e9,  1e10, 1e11, 1e12, 1e13, 1e14, 1e15,
+				    1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+    const char *c = tok, *e = tok + len;
+    bool neg = false;
+    if (c < e && (*c == '-' || *c == '+')) neg = (*c++ == '-');
+    guint64 mantissa = 0;
+    int digits = 0, exponent = 0;
+    bool any = false;
+    for (; c < e && *c >= '0' && *c <= '9'; c++, any = true)
+      if (mantissa > 0 || *c != '0') {
+	if (digits < 19) { mantissa = 10*mantissa + (*c - '0'); digits++; }
+	else exponent++;
       }
+    if (c < e && *c == '.') {
+      for (c++; c < e && *c >= '0' && *c <= '9'; c++, any = true) {
+	if (mantissa == 0 && *c == '0')
+	  exponent--;
+	else if (digits < 19) {
+	  mantissa = 10*mantissa + (*c - '0'); digits++; exponent--;
+	}
+      }
+    }
+    if (any && c < e && (*c == 'e' || *c == 'E')) {
+      const char *x = c + 1;
+      bool eneg = false;
+      if (x < e && (*x == '-' || *x == '+')) eneg = (*x++ == '-');
+      int ex = 0;
+      const char *xd = x;
+      for (; x < e && *x >= '0' && *x <= '9'; x++)
+	if (ex < 10000) ex = 10*ex + (*x - '0');
+      if (x > xd) { exponent += eneg ? -ex : ex; c = x; }
     }
-    if (solid != "solid") {
+    if (any && c == e && digits <= 15 && exponent >= -22 && exponent <= 22) {
+      // exact mantissa and power of ten: one correctly rounded operation
+      d = double(mantissa);
+      if (exponent < 0) d /= pow10[-exponent];
+      else              d *= pow10[exponent];
+      if (neg) d = -d;
+      return true;
+    }
+    // long mantissa, large exponent, inf, nan...
+    if (len >= 64) return false;
+    char buf[64];
+    memcpy(buf, tok, len);
+    buf[len] = '\0';
+    char *stop;
+    d = g_ascii_strtod(buf, &stop);
+    return stop == buf + len;
+  };
+};
+
+// parse the facets in [begin, end), keeping every step-th
+static bool parse_facets(const char *begin, const char *end,
+			 uint step, bool readnormals,
+			 vector<Triangle> &triangles, string &err)
+{
+  STLTokenizer text(begin, end);
+  for (uint num = 0; text.next(); num++) {
+    if (!text.is("facet")) {
+      err = _("Error: Facet keyword not found in STL text!");
       return false;
     }
-
-    // uint itr = 0;
-    while(!text.eof()) { // Loop around all triangles
-      string facet;
-        text >> facet;
-	//cerr << text.tellg() << " - " << fsize << " - " <<facet << endl;
-	if (step > 1) {
-	  for (uint s=0; s < step; s++) {
-	    if (text.eof()) break;
-	    facet = "";
-	    while (facet != "facet" && facet != "endsolid"){
-	      if (text.eof()) break;
-	      text >> facet;
-	    }
-	    if (facet == "endsolid") {
-	      break;
-	    }
-	  }
-	}
-        // Parse possible end of text - "endsolid"
-        if(text.eof() || facet == "endsolid" ) {
-	  break;
-        }
-
-        if(facet != "facet") {
-	  cerr << _("Error: Facet keyword not found in STL text!") << endl;
-	  return false;
-        }
-
-        // Parse Face Normal - "normal %f %f %f"
-        string normal;
-        Vector3d normal_vec;
-        text >> normal;
-        if(readnormals && normal != "normal") {
-	  cerr << _("Error: normal keyword not found in STL text!") << endl;
-	  return false;
-	}
-
-	if (readnormals){
-	  text >> normal_vec.x()
-	       >> normal_vec.y()
-	       >> normal_vec.z();
-	}
-
-        // Parse "outer loop" line
-        string outer, loop;
-	while (outer!="outer" && !text.eof()) {
-	  text >> outer;
-	}
-	text >> loop;
-	if(outer != "outer" || loop != "loop") {
-	  cerr << _("Error: Outer/Loop keywords not found!") << endl;
+    // Parse Face Normal - "normal %f %f %f"
+    Vector3d normal_vec;
+    if (readnormals) {
+      if (!text.expect("normal")) {
+	err = _("Error: normal keyword not found in STL text!");
+	return false;
+      }
+      for (uint i = 0; i < 3; i++)
+	if (!text.number(normal_vec[i])) {
+	  err = _("Error: normal keyword not found in STL text!");
 	  return false;
 	}
+    }
+    // Parse "outer loop" line
+    while (text.next() && !text.is("outer")) ;
+    if (!text.is("outer") || !text.expect("loop")) {
+      err = _("Error: Outer/Loop keywords not found!");
+      return false;
+    }
+    // Grab the 3 vertices - each one of the form "vertex %f %f %f"
+    Vector3d vertices[3];
+    for (uint i = 0; i < 3; i++)
+      if (!text.expect("vertex") ||
+	  !text.number(vertices[i].x()) ||
+	  !text.number(vertices[i].y()) ||
+	  !text.number(vertices[i].z())) {
+	err = _("Error: Vertex keyword not found");
+	return false;
+      }
+    // Parse end of vertices loop - "endloop endfacet"
+    if (!text.expect("endloop") || !text.expect("endfacet")) {
+      err = _("Error: Endloop or endfacet keyword not found");
+      return false;
+    }
+    if (num % step != 0) continue;
+    Triangle triangle(vertices[0], vertices[1], vertices[2]);
+    if (readnormals)
+      if (triangle.Normal.dot(normal_vec) < 0) triangle.invertNormal();
+    triangles.push_back(triangle);
+  }
+  return true;
+}
 
-        // Grab the 3 vertices - each one of the form "vertex %f %f %f"
-        Vector3d vertices[3];
-        for(int i=0; i<3; i++) {
-	    string vertex;
-            text >> vertex
-		 >> vertices[i].x()
-		 >> vertices[i].y()
-		 >> vertices[i].z();
-
-            if(vertex != "vertex") {
-	      cerr << _("Error: Vertex keyword not found") << endl;
-	      return false;
-            }
-        }
-
-        // Parse end of vertices loop - "endloop endfacet"
-        string endloop, endfacet;
-        text >> endloop >> endfacet;
-
-        if(endloop != "endloop" || endfacet != "endfacet") {
-	  cerr << _("Error: Endloop or endfacet keyword not found") << endl;
-	  return false;
-        }
-
-        // Create triangle object and push onto the vector
-        Triangle triangle(vertices[0],
-			  vertices[1],
-			  vertices[2]);
-	if (readnormals){
-	  //cerr << "reading normals from file" << endl;
-	  if (triangle.Normal.dot(normal_vec) < 0) triangle.invertNormal();
-	}
+// Every "solid" block becomes a shape. The facets of a block are split
+// into chunks at facet keywords, parsed concurrently and joined in order.
+bool File::parseSTLsolids_ascii(const char *data, size_t size,
+				uint max_triangles, bool readnormals,
+				vector< vector<Triangle> > &triangles,
+				vector<ustring> &names)
+{
+  if (data == NULL) return false;
+  const char *start = data, *end = data + size;
+  const char *p = start;
+  uint nsolids = 0;
+  while (true) {
+    // Find next solid, the rest of its line is the name
+    const char *solid = find_word(p, start, end, "solid");
+    if (solid == end) break;
+    const char *body = end_of_line(solid, end);
+    const ustring name(string(solid + 5, body));
+    const char *body_end = find_word(body, start, end, "endsolid");
+    p = end_of_line(body_end, end);
+
+    const char *first = find_word(body, start, body_end, "facet");
+    uint step = 1;
+    if (max_triangles > 0 && first != body_end) {
+      // estimate the number of facets by the size of the first one
+      const char *second = find_word(first + 5, start, body_end, "facet");
+      const size_t num = (body_end - first) / (second - first);
+      if (max_triangles < num)
+	step = (num + max_triangles - 1) / max_triangles;
+    }
 
-        triangles.push_back(triangle);
+    // chunks of at least 1 MB
+    int nchunks = 1;
+#ifdef _OPENMP
+    nchunks = 4 * omp_get_max_threads();
+#endif
+    nchunks = max(1, min(nchunks, int((body_end - first) >> 20)));
+    // with sampling, each chunk counts its own facets
+    if (step > 1) nchunks = 1;
+    // text before the first facet must be whitespace
+    vector<const char *> bounds(nchunks + 1);
+    bounds[0] = body;
+    bounds[nchunks] = body_end;
+    for (int c = 1; c < nchunks; c++)
+      bounds[c] = find_word(max(bounds[c-1], first + (body_end - first) / nchunks * c),
+			    start, body_end, "facet");
+
+    vector< vector<Triangle> > parts(nchunks);
+    vector<string> errors(nchunks);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+    for (int c = 0; c < nchunks; c++) {
+      parts[c].reserve((bounds[c+1] - bounds[c]) / 200 / step);
+      parse_facets(bounds[c], bounds[c+1], step, readnormals,
+		   parts[c], errors[c]);
     }
-    //cerr << "loaded " << filename << endl;
-    return true;
+    int failed = 0;
+    while (failed < nchunks && errors[failed] == "") failed++;
+    if (failed < nchunks) {
+      cerr << errors[failed] << endl;
+      break;
+    }
+    size_t total = 0;
+    for (int c = 0; c < nchunks; c++) total += parts[c].size();
+    triangles.push_back(vector<Triangle>());
+    vector<Triangle> &tr = triangles.back();
+    tr.reserve(total);
+    for (int c = 0; c < nchunks; c++) {
+      tr.insert(tr.end(), parts[c].begin(), parts[c].end());
+      vector<Triangle>().swap(parts[c]);
+    }
+    names.push_back(name);
+    nsolids++;
+  }
+  return nsolids > 0;
 }
 
+
 bool File::load_VRML(vector<Triangle> &triangles, uint max_triangles)
 
 {
@@ -23,6 +23,7 @@
 #include "stdafx.h"
 
 #include "triangle.h"
+#include "mesh.h"
 
 
 void save_locales();
@@ -56,16 +57,16 @@ public:
 
   static filetype_t getFileType(ustring path);
 
-  void loadTriangles(vector< vector<Triangle> > &triangles,
-		     vector<ustring> &names,
-		     uint max_triangles=0);
+  void loadMeshes(vector<Mesh> &meshes,
+		  vector<ustring> &names,
+		  uint max_triangles=0);
 
 
   bool load_asciiSTL(vector< vector<Triangle> > &triangles,
 		     vector<ustring> &names,
 		     uint max_triangles=0, bool readnormals=false);
 
-  bool load_binarySTL(vector<Triangle> &triangles,
+  bool load_binarySTL(Mesh &mesh,
 		      uint max_triangles=0, bool readnormals=false);
 
   bool load_VRML(vector<Triangle> &triangles, uint max_triangles=0);
@@ -79,10 +80,15 @@ public:
 			const vector<ustring> &names,
 			bool compressed = true);
 
-  static bool parseSTLtriangles_ascii(istream &text,
-				      uint max_triangles, bool readnormals,
-				      vector<Triangle> &triangles,
-				      ustring &name);
+  // solids of an ASCII STL file in memory, one shape per solid
+  static bool parseSTLsolids_ascii(const char *data, size_t size,
+				   uint max_triangles, bool readnormals,
+				   vector< vector<Triangle> > &triangles,
+				   vector<ustring> &names);
+  // records of a binary STL file in memory, 3 corners per triangle
+  static bool parseSTLtriangles_binary(const char *data, size_t size,
+				       uint max_triangles, bool readnormals,
+				       vector<Vector3d> &corners);
 
 
   /* static bool loadVRMLtriangles(ustring filename, */
@@ -169,7 +169,8 @@ bool FlatShape::getPolygonsAtZ(const Matrix4d &T, double z,
 			       vector<Poly> &polys, double &max_grad,
 			       vector<Poly> &supportpolys,
 			       double max_supportangle,
-			       double thickness) const
+			       double thickness,
+			       const vector<uint> *triangle_indices) const
 {
   max_grad = 0;
   polys = polygons;
@@ -43,7 +43,8 @@ class FlatShape : public Shape
   		      vector<Poly> &polys, double &max_grad,
 		      vector<Poly> &supportpolys,
 		      double max_supportangle=-1,
-		      double thickness=-1) const;
+		      double thickness=-1,
+		      const vector<uint> *triangle_indices=NULL) const;
 
 
   /* int load(std::string filename); */
@@ -0,0 +1,260 @@
+/*
+    This file is a part of the RepSnapper project.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "mesh.h"
+#include "geometry.h"
+#include "ui/progress.h"
+
+#include <climits>
+
+
+void UnionFind::reset(uint n)
+{
+  parent.resize(n);
+  for (uint i = 0; i < n; i++) parent[i] = i;
+}
+
+// with path halving
+uint UnionFind::find(uint i)
+{
+  while (parent[i] != i) {
+    parent[i] = parent[parent[i]];
+    i = parent[i];
+  }
+  return i;
+}
+
+void UnionFind::unite(uint a, uint b)
+{
+  a = find(a);
+  b = find(b);
+  if (a < b) parent[b] = a;
+  else if (b < a) parent[a] = b;
+}
+
+
+void Mesh::clear()
+{
+  vertices.clear();
+  indices.clear();
+}
+
+// sort corner indices by their coordinates
+struct CornerLess {
+  const vector<Vector3d> &corners;
+  CornerLess(const vector<Vector3d> &corners_) : corners(corners_) {};
+  bool operator()(uint a, uint b) const {
+    const Vector3d &va = corners[a], &vb = corners[b];
+    if (va.x() != vb.x()) return va.x() < vb.x();
+    if (va.y() != vb.y()) return va.y() < vb.y();
+    return va.z() < vb.z();
+  };
+};
+
+// join identical corners, vertices are numbered in order of first use
+void Mesh::build(const vector<Vector3d> &corners)
+{
+  const uint ncorners = corners.size();
+  vector<uint> order(ncorners);
+  for (uint c = 0; c < ncorners; c++) order[c] = c;
+  CornerLess less(corners);
+  std::stable_sort(order.begin(), order.end(), less);
+  // first corner of each group of identical ones
+  vector<uint> first(ncorners);
+  for (uint c = 0; c < ncorners; c++) {
+    if (c == 0 || less(order[c-1], order[c]))
+      first[order[c]] = order[c];
+    else
+      first[order[c]] = first[order[c-1]];
+  }
+  vertices.clear();
+  indices.resize(ncorners);
+  for (uint c = 0; c < ncorners; c++) {
+    if (first[c] == c) {
+      indices[c] = vertices.size();
+      vertices.push_back(corners[c]);
+    } else
+      indices[c] = indices[first[c]];
+  }
+  vector<Vector3d>(vertices).swap(vertices); // no spare capacity
+}
+
+void Mesh::setTriangles(const vector<Triangle> &triangles)
+{
+  vector<Vector3d> corners(3*triangles.size());
+  for (uint i = 0; i < triangles.size(); i++)
+    for (uint k = 0; k < 3; k++)
+      corners[3*i+k] = triangles[i][k];
+  build(corners);
+}
+
+void Mesh::addTriangles(const vector<Triangle> &triangles)
+{
+  vector<Vector3d> corners(indices.size() + 3*triangles.size());
+  for (uint c = 0; c < indices.size(); c++)
+    corners[c] = vertices[indices[c]];
+  for (uint i = 0; i < triangles.size(); i++)
+    for (uint k = 0; k < 3; k++)
+      corners[indices.size()+3*i+k] = triangles[i][k];
+  build(corners);
+}
+
+void Mesh::getTriangles(vector<Triangle> &triangles, const Matrix4d &T) const
+{
+  const uint nfaces = size();
+  triangles.resize(nfaces);
+  for (uint i = 0; i < nfaces; i++)
+    triangles[i] = Triangle(T*vertex(i,0), T*vertex(i,1), T*vertex(i,2));
+}
+
+Vector3d Mesh::normal(uint face) const
+{
+  const Vector3d AA = vertex(face,2) - vertex(face,0);
+  const Vector3d BB = vertex(face,2) - vertex(face,1);
+  return normalized(AA.cross(BB));
+}
+
+void Mesh::invertFaces()
+{
+  for (uint i = 0; i < size(); i++)
+    invertFace(i);
+}
+
+// vertex index sorted by grid cell
+struct CellVertex {
+  int x, y, z;
+  uint v;
+  bool operator<(const CellVertex &o) const {
+    if (x != o.x) return x < o.x;
+    if (y != o.y) return y < o.y;
+    if (z != o.z) return z < o.z;
+    return v < o.v;
+  };
+};
+
+static inline uint cell_hash(int x, int y, int z)
+{
+  return (uint)x * 73856093u ^ (uint)y * 19349663u ^ (uint)z * 83492791u;
+}
+
+// Near vertices are in the same or a neighbouring grid cell. The sorted
+// vertices form runs of equal cells, found through a hash table; every
+// pair of cells is checked once.
+bool Mesh::uniteNearVertices(double sqdistance, UnionFind &groups,
+			     ViewProgress *progress) const
+{
+  const uint n_v = numVertices();
+  const double cellsize = sqrt(sqdistance);
+  if (cellsize <= 0 || n_v == 0) return true;
+  vector<CellVertex> cells(n_v);
+  for (uint v = 0; v < n_v; v++) {
+    cells[v].x = (int)floor(vertices[v].x()/cellsize);
+    cells[v].y = (int)floor(vertices[v].y()/cellsize);
+    cells[v].z = (int)floor(vertices[v].z()/cellsize);
+    cells[v].v = v;
+  }
+  std::sort(cells.begin(), cells.end());
+
+  vector<uint> runs; // start of each run, and the end
+  for (uint c = 0; c < n_v; c++)
+    if (c == 0 || cells[c-1].x != cells[c].x || cells[c-1].y != cells[c].y
+	|| cells[c-1].z != cells[c].z)
+      runs.push_back(c);
+  const uint nruns = runs.size();
+  runs.push_back(n_v);
+  uint tablesize = 1;
+  while (tablesize < 2*nruns) tablesize <<= 1;
+  const uint mask = tablesize - 1;
+  vector<uint> table(tablesize, UINT_MAX); // run index
+  for (uint r = 0; r < nruns; r++) {
+    const CellVertex &cv = cells[runs[r]];
+    uint h = cell_hash(cv.x, cv.y, cv.z) & mask;
+    while (table[h] != UINT_MAX) h = (h + 1) & mask;
+    table[h] = r;
+  }
+
+  const uint progress_steps = max(1u, nruns/100);
+  for (uint r = 0; r < nruns; r++) {
+    if (progress && r%progress_steps == 0)
+      if (!progress->update(runs[r])) return false;
+    const CellVertex &cv = cells[runs[r]];
+    // this cell and the 13 neighbours following it in sort order
+    for (int dx = 0; dx <= 1; dx++)
+      for (int dy = (dx ? -1 : 0); dy <= 1; dy++)
+	for (int dz = (dx || dy ? -1 : 0); dz <= 1; dz++) {
+	  const int x = cv.x+dx, y = cv.y+dy, z = cv.z+dz;
+	  uint h = cell_hash(x, y, z) & mask;
+	  uint r2 = UINT_MAX;
+	  for (; table[h] != UINT_MAX; h = (h + 1) & mask) {
+	    const CellVertex &o = cells[runs[table[h]]];
+	    if (o.x == x && o.y == y && o.z == z) { r2 = table[h]; break; }
+	  }
+	  if (r2 == UINT_MAX) continue;
+	  for (uint i = runs[r]; i < runs[r+1]; i++) {
+	    const Vector3d &p = vertices[cells[i].v];
+	    for (uint j = (r2 == r ? i+1 : runs[r2]); j < runs[r2+1]; j++)
+	      if (groups.find(cells[i].v) != groups.find(cells[j].v)
+		  && p.squared_distance(vertices[cells[j].v]) < sqdistance)
+		groups.unite(cells[i].v, cells[j].v);
+	  }
+	}
+  }
+  return true;
+}
+
+uint Mesh::weldVertices(double distance)
+{
+  const uint n_v = numVertices();
+  UnionFind groups(n_v);
+  uniteNearVertices(distance*distance, groups);
+  vector<uint> newindex(n_v);
+  vector<Vector3d> welded;
+  for (uint v = 0; v < n_v; v++) {
+    const uint root = groups.find(v);
+    if (root == v) {
+      newindex[v] = welded.size();
+      welded.push_back(vertices[v]);
+    } else
+      newindex[v] = newindex[root];
+  }
+  if (welded.size() == n_v) return 0;
+  vertices.swap(welded);
+  uint f = 0;
+  for (uint i = 0; i < size(); i++) {
+    const uint a = newindex[indices[3*i]], b = newindex[indices[3*i+1]],
+      c = newindex[indices[3*i+2]];
+    if (a == b || b == c || c == a) continue;
+    indices[3*f] = a; indices[3*f+1] = b; indices[3*f+2] = c;
+    f++;
+  }
+  indices.resize(3*f);
+  return n_v - vertices.size();
+}
+
+
+SharedMesh::~SharedMesh()
+{
+  clearList();
+}
+
+void SharedMesh::clearList() const
+{
+  if (gl_List>=0)
+    glDeleteLists(gl_List,1);
+  gl_List = -1;
+}
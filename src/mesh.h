@@ -0,0 +1,132 @@
+/*
+    This file is a part of the RepSnapper project.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#pragma once
+
+#include "stdafx.h"
+#include "triangle.h"
+
+
+// Disjoint sets of indices, the lowest index of a set is its root.
+class UnionFind
+{
+public:
+  UnionFind(uint n = 0) { reset(n); };
+  void reset(uint n);
+  uint find(uint i);
+  void unite(uint a, uint b);
+private:
+  vector<uint> parent;
+};
+
+
+// Indexed triangle mesh: every distinct vertex is stored once and faces
+// refer to their 3 vertices by index, in winding order. Normals follow
+// the winding (like Triangle::calcNormal) and are computed when needed.
+class Mesh
+{
+public:
+  Mesh() {};
+
+  void clear();
+  uint size() const { return indices.size()/3; };
+  uint numVertices() const { return vertices.size(); };
+
+  void setTriangles(const vector<Triangle> &triangles);
+  // 3 corners per face in winding order, identical ones are joined
+  void setCorners(const vector<Vector3d> &corners) { build(corners); };
+  // joins the new corners with all existing ones again, so add
+  // many triangles at once rather than in a loop
+  void addTriangles(const vector<Triangle> &triangles);
+  // all faces as triangles, transformed by T
+  void getTriangles(vector<Triangle> &triangles,
+		    const Matrix4d &T=Matrix4d::IDENTITY) const;
+
+  Triangle triangle(uint face) const
+  { return Triangle(vertex(face,0), vertex(face,1), vertex(face,2)); };
+  Vector3d normal(uint face) const;
+
+  // corner k of a face
+  const Vector3d &vertex(uint face, uint k) const
+  { return vertices[indices[3*face+k]]; };
+  uint vertexIndex(uint face, uint k) const { return indices[3*face+k]; };
+
+  const Vector3d &getVertex(uint v) const { return vertices[v]; };
+  void setVertex(uint v, const Vector3d &p) { vertices[v] = p; };
+
+  uint addVertex(const Vector3d &p)
+  { vertices.push_back(p); return vertices.size()-1; };
+  void addFace(uint a, uint b, uint c)
+  { indices.push_back(a); indices.push_back(b); indices.push_back(c); };
+
+  // unite vertices closer than sqrt(sqdistance), false if cancelled
+  bool uniteNearVertices(double sqdistance, UnionFind &groups,
+			 ViewProgress *progress = NULL) const;
+  // merge vertices closer than distance into the first of them and
+  // remove the faces that collapse, returns the number of removed vertices
+  uint weldVertices(double distance);
+
+  // reverse the winding of all faces (like Triangle::invertNormal)
+  void invertFaces();
+  void invertFace(uint face) { std::swap(indices[3*face], indices[3*face+2]); };
+
+  void swap(Mesh &other)
+  { vertices.swap(other.vertices); indices.swap(other.indices); };
+
+  // same vertices and faces in the same order
+  bool sameGeometry(const Mesh &other) const
+  { return this == &other ||
+      (indices == other.indices && vertices == other.vertices); };
+
+  size_t memoryUsed() const
+  { return vertices.capacity()*sizeof(Vector3d) + indices.capacity()*sizeof(uint); };
+
+private:
+  vector<Vector3d> vertices;
+  vector<uint> indices;       // 3 per face
+
+  void build(const vector<Vector3d> &corners);
+};
+
+
+// Immutable mesh shared between shapes through Glib::RefPtr, with the
+// display list drawing it. Duplicated shapes reference the same one and
+// a shape copies it only before changing its geometry (copy on write).
+class SharedMesh
+{
+public:
+  SharedMesh() : gl_List(-1), refcount(1) {};
+  SharedMesh(const Mesh &mesh_) : mesh(mesh_), gl_List(-1), refcount(1) {};
+  ~SharedMesh();
+
+  void reference() const { g_atomic_int_inc(&refcount); };
+  void unreference() const
+  { if (g_atomic_int_dec_and_test(&refcount)) delete this; };
+  bool isShared() const { return g_atomic_int_get(&refcount) > 1; };
+
+  // delete the display list, it has to be built again
+  void clearList() const;
+
+  Mesh mesh;
+  mutable int gl_List;
+
+private:
+  mutable gint refcount;
+  SharedMesh(const SharedMesh &);
+  SharedMesh &operator=(const SharedMesh &);
+};
@@ -183,13 +183,15 @@ vector<Shape*> Model::ReadShapes(Glib::RefPtr<Gio::File> file,
   vector<Shape*> shapes;
   if (file==0) return shapes;
   File sfile(file);
-  vector< vector<Triangle> > triangles;
+  vector<Mesh> meshes;
   vector<ustring> shapenames;
-  sfile.loadTriangles(triangles, shapenames, max_triangles);
-  for (uint i = 0; i < triangles.size(); i++) {
-    if (triangles[i].size() > 0) {
+  sfile.loadMeshes(meshes, shapenames, max_triangles);
+  for (uint i = 0; i < meshes.size(); i++) {
+    if (meshes[i].size() > 0) {
       Shape *shape = new Shape();
-      shape->setTriangles(triangles[i]);
+      shape->setMesh(meshes[i]);
+      if (settings.get_boolean("Misc","RepairOnLoad"))
+	shape->repairMesh(0.001, settings.get_boolean("Misc","RepairCloseHoles"));
       shape->filename = shapenames[i];
       shape->FitToVolume(settings.getPrintVolume() - 2.*settings.getPrintMargin());
       shapes.push_back(shape);
@@ -242,13 +244,16 @@ void Model::SaveStl(Glib::RefPtr<Gio::File> file)
 Shape Model::GetCombinedShape() const
 {
   Shape shape;
+  // gathered first, adding rebuilds the mesh
+  vector<Triangle> alltr;
   for (uint o = 0; o<objtree.Objects.size(); o++) {
     for (uint s = 0; s<objtree.Objects[o]->shapes.size(); s++) {
       vector<Triangle> tr =
 	objtree.Objects[o]->shapes[s]->getTriangles(objtree.Objects[o]->transform3D.transform);
-      shape.addTriangles(tr);
+      alltr.insert(alltr.end(), tr.begin(), tr.end());
     }
   }
+  shape.addTriangles(alltr);
   return shape;
 }
 
@@ -568,10 +573,13 @@ int Model::SplitShape(TreeObject *parent, Shape *shape, string filename)
 int Model::MergeShapes(TreeObject *parent, const vector<Shape*> shapes)
 {
   Shape * shape = new Shape();
+  // gathered first, adding rebuilds the mesh
+  vector<Triangle> alltr;
   for (uint s = 0; s <  shapes.size(); s++) {
     vector<Triangle> str = shapes[s]->getTriangles();
-    shape->addTriangles(str);
+    alltr.insert(alltr.end(), str.begin(), str.end());
   }
+  shape->addTriangles(alltr);
   AddShape(parent, shape, "merged", true);
   return 1;
 }
@@ -666,7 +674,10 @@ void Model::OptimizeRotation(Shape *shape, TreeObject *object)
 {
   if (!shape)
     return; // FIXME: rotate entire Objects ...
-  shape->OptimizeRotation();
+  double supportangle = -1;
+  if (settings.get_boolean("Slicing","Support"))
+    supportangle = settings.get_double("Slicing","SupportAngle")*M_PI/180.;
+  shape->OptimizeRotation(supportangle);
   ModelChanged();
 }
 
@@ -1113,6 +1124,7 @@ Layer * Model::calcSingleLayer(double z, uint LayerNr, double thickness,
 			    settings.get_integer("Slicing","Skins"));
   layer->setZ(z);
   for(size_t f = 0; f < shapes.size(); f++) {
+    shapes[f]->prepareSlicing(transforms[f]); // only rebuilt if changed
     layer->addShape(transforms[f], *shapes[f], z, max_grad, supportangle);
   }
 
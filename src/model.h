@@ -105,6 +105,7 @@ public:
 
 	// Slicing
 	void SliceToSVG(Glib::RefPtr<Gio::File> file, bool single_layer=false);
+	void BenchmarkCutting();
 
 	// GCode Functions
 	void init();
@@ -185,11 +186,9 @@ public:
 	void MakeShells();
 	void MakeUncoveredPolygons(bool make_decor, bool make_bridges=true);
 	vector<Poly> GetUncoveredPolygons(const Layer *subjlayer,
-					  const Layer *cliplayer);
+					  const Layer *cliplayer) const;
 	void MakeFullSkins();
 	void MultiplyUncoveredPolygons();
-	void MakeSupportPolygons(Layer * subjlayer, const Layer * cliplayer,
-				 double widen=0);
 	void MakeSupportPolygons(double widen=0);
 	void MakeSkirt();
 
@@ -278,6 +278,51 @@ bool layersort(const Layer * l1, const Layer * l2){
   return (l1->Z < l2->Z);
 }
 
+// R with W_copy = R * W_shape, if R only rotates about z and moves in xy
+static bool planar_motion(const Matrix4d &W_copy, const Matrix4d &W_shape,
+			  Matrix4d &R)
+{
+  Matrix4d inv;
+  if (!W_shape.inverse(inv)) return false;
+  R = W_copy * inv;
+  const double w = R(3,3), eps = 1e-9;
+  if (fabs(w) < eps) return false;
+  R *= 1./w;
+  const double c = R(0,0), s = R(1,0);
+  return fabs(c*c + s*s - 1) < eps
+    && fabs(R(1,1) - c) < eps && fabs(R(0,1) + s) < eps
+    && fabs(R(0,2)) < eps && fabs(R(1,2)) < eps
+    && fabs(R(2,0)) < eps && fabs(R(2,1)) < eps && fabs(R(2,2) - 1) < eps
+    && fabs(R(2,3)) < eps
+    && fabs(R(3,0)) < eps && fabs(R(3,1)) < eps && fabs(R(3,2)) < eps;
+}
+
+// Find shapes with the same geometry as an earlier one and a transformation
+// that differs by a rotation about z and a move in xy: these are sliced
+// once and their polygons copied. instances[s] holds the relative
+// transformations of the copies of shape s, copy_of[c] the shape of copy c.
+static void find_instances(const vector<Shape*> &shapes,
+			   const vector<Matrix4d> &transforms,
+			   vector<int> &copy_of,
+			   vector< vector<Matrix4d> > &instances)
+{
+  const uint n = shapes.size();
+  copy_of.assign(n, -1);
+  instances.assign(n, vector<Matrix4d>());
+  for (uint c = 1; c < n; c++) {
+    const Matrix4d W = transforms[c] * shapes[c]->transform3D.transform;
+    for (uint s = 0; s < c; s++) {
+      if (copy_of[s] >= 0 || !shapes[c]->sameGeometry(*shapes[s])) continue;
+      Matrix4d R;
+      if (planar_motion(W, transforms[s] * shapes[s]->transform3D.transform, R)) {
+	copy_of[c] = s;
+	instances[s].push_back(R);
+	break;
+      }
+    }
+  }
+}
+
 void Model::Slice()
 {
   vector<Shape*> shapes;
@@ -336,11 +381,24 @@ void Model::Slice()
     return;
   }
 
+  const bool serial = (varSlicing && skins > 1) ||
+    (settings.get_boolean("Slicing","BuildSerial") && shapes.size() > 1);
+
+  // copies of shapes get the polygons of their original
+  vector<int> copy_of(shapes.size(), -1);
+  vector< vector<Matrix4d> > instances(shapes.size());
+  if (!serial)
+    find_instances(shapes, transforms, copy_of, instances);
+
+  // index and transform triangles, once for all layers
+  for (uint nshape= 0; nshape < shapes.size(); nshape++)
+    if (copy_of[nshape] < 0)
+      shapes[nshape]->prepareSlicing(transforms[nshape]);
+
   int progress_steps=(int)(maxZ/thickness/100);
   if (progress_steps==0) progress_steps=1;
 
-  if ((varSlicing && skins > 1) ||
-      (settings.get_boolean("Slicing","BuildSerial") && shapes.size() > 1))
+  if (serial)
   {
     // have skins and/or serial build, so can't parallelise
     uint currentshape   = 0;
@@ -407,6 +465,8 @@ void Model::Slice()
         //cerr << "    Z="<<z << "Max.z="<<Max.z<<endl;
       }
     delete layer; // have made one more than needed
+    for (uint nshape= 0; nshape < shapes.size(); nshape++)
+      shapes[nshape]->finishSlicing();
     return;
   }
 
@@ -414,15 +474,34 @@ void Model::Slice()
 
   int num_layers = (int)ceil((maxZ - minZ) / thickness);
   layers.resize(num_layers);
-  int nlayer;
   bool cont = true;
 
+  // With sweep slicing every thread sweeps a band of layers, keeping
+  // the set of cut triangles from one layer to the next. Otherwise
+  // every layer is a band of its own.
+  const bool sweep = settings.get_boolean("Slicing","SweepSlicing");
+  int num_bands = num_layers;
+  if (sweep) {
+    num_bands = 1;
+#ifdef _OPENMP
+    num_bands = omp_get_max_threads();
+#endif
+    num_bands = max(1, min(num_bands, num_layers));
+  }
+
 #ifdef _OPENMP
   #pragma omp parallel for schedule(dynamic)
 #endif
-  for (nlayer = 0; nlayer < num_layers; nlayer++) {
-    double z = minZ + thickness * nlayer;
-    if (nlayer%progress_steps==0) {
+  for (int band = 0; band < num_bands; band++) {
+    vector<TriangleSweep> sweeps;
+    if (sweep)
+      for (uint nshape= 0; nshape < shapes.size(); nshape++)
+	sweeps.push_back(TriangleSweep(shapes[nshape]->getZIndex()));
+    const int first_layer = band * num_layers / num_bands;
+    const int end_layer = (band+1) * num_layers / num_bands;
+    for (int nlayer = first_layer; nlayer < end_layer; nlayer++) {
+      double z = minZ + thickness * nlayer;
+      if (nlayer%progress_steps==0) {
 #ifdef _OPENMP
 	#pragma omp critical(updateProgress)
 	{
@@ -430,23 +509,27 @@ void Model::Slice()
 	    #pragma omp flush (cont)
 	}
 #else
-        cont = (m_progress->update(z));
+	cont = (m_progress->update(z));
 #endif
-    }
+      }
 #ifdef _OPENMP
-    #pragma omp flush (cont)
-    if (!cont) continue;
-#else
-    if (!cont) break;
+      #pragma omp flush (cont)
 #endif
-    Layer * layer = new Layer(NULL, nlayer, thickness, nlayer>0?skins:1);
-    layer->setZ(z); // set to real z
-    for (uint nshape= 0; nshape < shapes.size(); nshape++) {
-      layer->addShape(transforms[nshape], *shapes[nshape],
-		      z, max_gradient, supportangle);
+      if (!cont) break;
+      Layer * layer = new Layer(NULL, nlayer, thickness, nlayer>0?skins:1);
+      layer->setZ(z); // set to real z
+      for (uint nshape= 0; nshape < shapes.size(); nshape++) {
+	if (copy_of[nshape] >= 0) continue;
+	layer->addShape(transforms[nshape], *shapes[nshape],
+			z, max_gradient, supportangle,
+			sweep ? &sweeps[nshape] : NULL,
+			instances[nshape].size() > 0 ? &instances[nshape] : NULL);
+      }
+      layers[nlayer] = layer;
     }
-    layers[nlayer] = layer;
   }
+  for (uint nshape= 0; nshape < shapes.size(); nshape++)
+    shapes[nshape]->finishSlicing();
   if (!cont)
     ClearLayers();
 
@@ -495,47 +578,65 @@ void Model::MakeFullSkins()
 }
 
 
+// Every layer only changes its own fill polygons here and reads the inner
+// shells of its neighbours, which stay as they are, so the layers are
+// done in parallel, each in the order of the former serial sweeps:
+// uncovered from above, then from below, then the first and last layer.
 void Model::MakeUncoveredPolygons(bool make_decor, bool make_bridges)
 {
   int count = (int)layers.size();
   if (count == 0 ) return;
-  if (!m_progress->restart (_("Find Uncovered"), 2*count+2)) return;
-  int progress_steps=(int)((2*count+2)/100);
+  if (!m_progress->restart (_("Find Uncovered"), count)) return;
+  int progress_steps=(int)(count/100);
   if (progress_steps==0) progress_steps=1;
-  // bottom to top: uncovered from above -> top polys
-  for (int i = 0; i < count-1; i++)
-    {
-      if (i%progress_steps==0) if(!m_progress->update(i)) return ;
-      layers[i]->addFullPolygons(GetUncoveredPolygons(layers[i],layers[i+1]), make_decor);
-    }
-  // top to bottom: uncovered from below -> bridge polys
-  for (uint i = count-1; i > 0; i--)
+  bool cont = true;
+#ifdef _OPENMP
+  omp_lock_t progress_lock;
+  omp_init_lock(&progress_lock);
+#pragma omp parallel for schedule(dynamic)
+#endif
+  for (int i = 0; i < count; i++)
     {
-      //cerr << "layer " << i << endl;
-      if (i%progress_steps==0) if(!m_progress->update(count + count - i)) return;
-      //make_bridges = false;
-      // no bridge on marked layers (serial build)
-      bool mbridge = make_bridges && (layers[i]->LayerNo != 0);
-      if (mbridge) {
-	vector<Poly> uncovered = GetUncoveredPolygons(layers[i],layers[i-1]);
-	layers[i]->addBridgePolygons(Clipping::getExPolys(uncovered));
-	layers[i]->calcBridgeAngles(layers[i-1]);
+      if (i%progress_steps==0) {
+#ifdef _OPENMP
+	omp_set_lock(&progress_lock);
+#endif
+	cont = (m_progress->update(i));
+#ifdef _OPENMP
+	omp_unset_lock(&progress_lock);
+#endif
       }
-      else {
-	const vector<Poly> &uncovered = GetUncoveredPolygons(layers[i],layers[i-1]);
-	layers[i]->addFullPolygons(uncovered,make_decor);
+      if (!cont) continue;
+      Layer *layer = layers[i];
+      // uncovered from above -> top polys
+      if (i < count-1)
+	layer->addFullPolygons(GetUncoveredPolygons(layer,layers[i+1]), make_decor);
+      // uncovered from below -> bridge polys
+      if (i > 0) {
+	// no bridge on marked layers (serial build)
+	const bool mbridge = make_bridges && (layer->LayerNo != 0);
+	const vector<Poly> uncovered = GetUncoveredPolygons(layer,layers[i-1]);
+	if (mbridge) {
+	  layer->addBridgePolygons(Clipping::getExPolys(uncovered));
+	  layer->calcBridgeAngles(layers[i-1]);
+	}
+	else
+	  layer->addFullPolygons(uncovered,make_decor);
       }
+      if (i == 0)
+	layer->addFullPolygons(layer->GetFillPolygons(), make_decor);
+      if (i == count-1)
+	layer->addFullPolygons(layer->GetFillPolygons(), make_decor);
     }
-  m_progress->update(2*count+1);
-  layers.front()->addFullPolygons(layers.front()->GetFillPolygons(), make_decor);
-  m_progress->update(2*count+2);
-  layers.back()->addFullPolygons(layers.back()->GetFillPolygons(), make_decor);
+#ifdef _OPENMP
+  omp_destroy_lock(&progress_lock);
+#endif
   //m_progress->stop (_("Done"));
 }
 
 // find polys in subjlayer that are not covered by shell of cliplayer
 vector<Poly> Model::GetUncoveredPolygons(const Layer * subjlayer,
-					 const Layer * cliplayer)
+					 const Layer * cliplayer) const
 {
   Clipping clipp;
   clipp.clear();
@@ -565,48 +666,76 @@ void Model::MultiplyUncoveredPolygons()
     numdecor = settings.get_integer("Slicing","DecorLayers");
   shells += numdecor;
 
-  if (!m_progress->restart (_("Uncovered Shells"), count*3)) return;
-  int progress_steps=(int)(count*3/100);
+  if (!m_progress->restart (_("Uncovered Shells"), count*2)) return;
+  int progress_steps=(int)(count*2/100);
   if (progress_steps==0) progress_steps=1;
-  // bottom-up: mulitply downwards
-  int i,s;
+  // Every layer gathers the full polygons of the layers within shells
+  // above (not to the base layers) and below it (also the bridges) and
+  // unites them, decor separately. Only the layers' own polygons are read
+  // here, so this is done for all layers before any of them changes.
+  vector< vector<Poly> > fullunion(count), decorunion(count);
+  bool cont = true;
+  int i;
+#ifdef _OPENMP
+  omp_lock_t progress_lock;
+  omp_init_lock(&progress_lock);
+#pragma omp parallel for schedule(dynamic)
+#endif
   for (i=0; i < count; i++)
     {
-      if (i%progress_steps==0) if(!m_progress->update(i)) return;
-      // (brigdepolys are not multiplied downwards)
-      const vector<Poly> &fullpolys     = layers[i]->GetFullFillPolygons();
-      const vector<Poly> &skinfullpolys = layers[i]->GetSkinFullPolygons();
-      const vector<Poly> &decorpolys    = layers[i]->GetDecorPolygons();
-      for (s=1; s < shells; s++)
-	if (i-s > 1) {
-	  layers[i-s]->addFullPolygons (fullpolys,     false);
-	  layers[i-s]->addFullPolygons (skinfullpolys, false);
-	  layers[i-s]->addFullPolygons (decorpolys,    s < numdecor);
+      if (i%progress_steps==0) {
+#ifdef _OPENMP
+	omp_set_lock(&progress_lock);
+#endif
+	cont = (m_progress->update(i));
+#ifdef _OPENMP
+	omp_unset_lock(&progress_lock);
+#endif
+      }
+      if (!cont) continue;
+      Clipping fullclipp, decorclipp;
+      bool havedecor = false;
+      for (int s=1; s < shells; s++) {
+	// (brigdepolys are not multiplied downwards)
+	if (i > 1 && i+s < count) {
+	  const Layer *above = layers[i+s];
+	  fullclipp.addPolys(above->GetFullFillPolygons(), subject);
+	  fullclipp.addPolys(above->GetSkinFullPolygons(), subject);
+	  if (s < numdecor) {
+	    decorclipp.addPolys(above->GetDecorPolygons(), subject);
+	    havedecor = true;
+	  } else
+	    fullclipp.addPolys(above->GetDecorPolygons(), subject);
 	}
-    }
-  // top-down: mulitply upwards
-  for (int i=count-1; i>=0; i--)
-    {
-      if (i%progress_steps==0) if (!m_progress->update(count + count -i)) return;
-      const vector<Poly>   &fullpolys     = layers[i]->GetFullFillPolygons();
-      const vector<ExPoly> &bridgepolys   = layers[i]->GetBridgePolygons();
-      const vector<Poly>   &skinfullpolys = layers[i]->GetSkinFullPolygons();
-      const vector<Poly>   &decorpolys    = layers[i]->GetDecorPolygons();
-      for (int s=1; s < shells; s++)
-	if (i+s < count){
-	  layers[i+s]->addFullPolygons (fullpolys,     false);
-	  layers[i+s]->addFullPolygons (bridgepolys,   false);
-	  layers[i+s]->addFullPolygons (skinfullpolys, false);
-	  layers[i+s]->addFullPolygons (decorpolys,    s < numdecor);
+	if (i-s >= 0) {
+	  const Layer *below = layers[i-s];
+	  fullclipp.addPolys(below->GetFullFillPolygons(), subject);
+	  fullclipp.addPolys(below->GetBridgePolygons(),   subject);
+	  fullclipp.addPolys(below->GetSkinFullPolygons(), subject);
+	  if (s < numdecor) {
+	    decorclipp.addPolys(below->GetDecorPolygons(), subject);
+	    havedecor = true;
+	  } else
+	    fullclipp.addPolys(below->GetDecorPolygons(), subject);
 	}
+      }
+      fullclipp.setZ(layers[i]->getZ());
+      fullunion[i] = fullclipp.unite(CL::pftNonZero, CL::pftNonZero);
+      if (havedecor) {
+	decorclipp.setZ(layers[i]->getZ());
+	decorunion[i] = decorclipp.unite(CL::pftNonZero, CL::pftNonZero);
+      }
     }
+  if (!cont) {
+#ifdef _OPENMP
+    omp_destroy_lock(&progress_lock);
+#endif
+    return;
+  }
 
   m_progress->set_label(_("Merging Full Polygons"));
-  // merge results
-  bool cont = true;
+  // add and merge results
 #ifdef _OPENMP
-  omp_lock_t progress_lock;
-  omp_init_lock(&progress_lock);
 #pragma omp parallel for schedule(dynamic)
 #endif
   for (i=0; i < count; i++)
@@ -615,12 +744,14 @@ void Model::MultiplyUncoveredPolygons()
 #ifdef _OPENMP
 	omp_set_lock(&progress_lock);
 #endif
-	cont = (m_progress->update(count + count +i));
+	cont = (m_progress->update(count +i));
 #ifdef _OPENMP
 	omp_unset_lock(&progress_lock);
 #endif
       }
       if (!cont) continue;
+      layers[i]->addFullPolygons(fullunion[i],  false);
+      layers[i]->addFullPolygons(decorunion[i], true);
       layers[i]->mergeFullPolygons(false);
     }
 #ifdef _OPENMP
@@ -629,22 +760,32 @@ void Model::MultiplyUncoveredPolygons()
 }
 
 
-void Model::MakeSupportPolygons(Layer * layer, // lower -> will change
-				const Layer * layerabove,  // upper
-				double widen)
+// tosupport and layerpolys are the clipper polygons of the triangles to
+// support in layerabove and of the outlines of layer
+static void make_support(const Settings &settings,
+			 Layer * layer, // lower -> will change
+			 const Layer * layerabove,  // upper
+			 const CL::Paths &tosupport,
+			 const CL::Paths &layerpolys,
+			 double widen)
 {
+  const vector<Poly> &supportabove = layerabove->GetSupportPolygons();
+  if (supportabove.empty() && tosupport.empty()) {
+    // nothing to subtract from, no clipping needed
+    layer->setSupportPolygons(vector<Poly>());
+    return;
+  }
   const double distance =
     settings.GetExtrudedMaterialWidth(layer->thickness);
   // vector<Poly> tosupport = Clipping::getOffset(layerabove->GetToSupportPolygons(),
   //  					       distance/2.);
   //vector<Poly> tosupport = Clipping::getMerged(layerabove->GetToSupportPolygons(),
   // 					       distance);
-  vector<Poly> tosupport = layerabove->GetToSupportPolygons();
 
   Clipping clipp;
-  clipp.addPolys(layerabove->GetSupportPolygons(),  subject);
-  clipp.addPolys(tosupport,                         subject);
-  clipp.addPolys(layer->GetPolygons(),              clip);
+  clipp.addPolys(supportabove,                      subject);
+  clipp.addPolygons(tosupport,                      subject);
+  clipp.addPolygons(layerpolys,                     clip);
   clipp.setZ(layer->getZ());
 
   vector<Poly> spolys = clipp.subtract(CL::pftNonZero,CL::pftEvenOdd);
@@ -657,6 +798,12 @@ void Model::MakeSupportPolygons(Layer * layer, // lower -> will change
   layer->setSupportPolygons(spolys);
 }
 
+// The support of a layer is made from the support of the layer above, so
+// this goes from top to bottom. Only the conversion of every layer's own
+// polygons for clipping is independent and done in parallel beforehand.
+// The first layer of an object in a serial build gets no support from
+// above, there the layers split into parts of their own, which are
+// done in parallel.
 void Model::MakeSupportPolygons(double widen)
 {
   int count = layers.size();
@@ -664,12 +811,49 @@ void Model::MakeSupportPolygons(double widen)
   int progress_steps=(int)(count*2/100);
   if (progress_steps==0) progress_steps=1;
 
+  vector<CL::Paths> tosupport(count), layerpolys(count);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+  for (int i=0; i<count; i++) {
+    tosupport[i]  = Clipping::getClipperPolygons(layers[i]->GetToSupportPolygons());
+    layerpolys[i] = Clipping::getClipperPolygons(layers[i]->GetPolygons());
+  }
+
+  // top layers of the parts
+  vector<int> tops;
   for (int i=count-1; i>0; i--)
+    if (i == count-1 || layers[i+1]->LayerNo == 0)
+      tops.push_back(i);
+  const int nparts = tops.size();
+  bool cont = true;
+#ifdef _OPENMP
+  omp_lock_t progress_lock;
+  omp_init_lock(&progress_lock);
+#pragma omp parallel for schedule(dynamic)
+#endif
+  for (int p=0; p<nparts; p++)
     {
-      if (i%progress_steps==0) if(! m_progress->update(count-i)) return;
-      if (layers[i]->LayerNo == 0) continue;
-      MakeSupportPolygons(layers[i-1], layers[i], widen);
+      for (int i=tops[p]; i>0; i--)
+	{
+	  if (i%progress_steps==0) {
+#ifdef _OPENMP
+	    omp_set_lock(&progress_lock);
+#endif
+	    cont = (m_progress->update(count-i));
+#ifdef _OPENMP
+	    omp_unset_lock(&progress_lock);
+#endif
+	  }
+	  if (!cont) break;
+	  if (layers[i]->LayerNo == 0) break;
+	  make_support(settings, layers[i-1], layers[i],
+		       tosupport[i], layerpolys[i-1], widen);
+	}
     }
+#ifdef _OPENMP
+  omp_destroy_lock(&progress_lock);
+#endif
 
   // // shrink a bit
   // Clipping clipp;
@@ -1021,3 +1205,18 @@ void Model::SliceToSVG(Glib::RefPtr<Gio::File> file, bool single_layer)
   is_calculating = false;
 }
 
+
+// time the triangle cut kernels on all shapes (command line --bench-cut)
+void Model::BenchmarkCutting()
+{
+  vector<Shape*> shapes;
+  vector<Matrix4d> transforms;
+  objtree.get_all_shapes(shapes,transforms);
+  const double thickness = settings.get_double("Slicing","LayerThickness");
+  for (uint i = 0; i < shapes.size(); i++) {
+    const Matrix4d T = settings.getBasicTransformation(transforms[i]);
+    shapes[i]->prepareSlicing(T);
+    shapes[i]->benchmarkCutting(T, thickness, cout);
+    shapes[i]->finishSlicing();
+  }
+}
@@ -45,12 +45,14 @@ public:
 	string printerdevice_path;
   string svg_output_path;
   bool svg_single_output;
+  bool bench_cut;
 	std::vector<std::string> files;
 private:
 	void init ()
 	{
 		// specify defaults here or in the block below
 		use_gui = true;
+		bench_cut = false;
 	}
 	void version ()
 	{
@@ -119,6 +121,10 @@ public:
 			}
 			else if (!strcmp (arg, "--version") || !strcmp (arg, "-v"))
 				version();
+			else if (!strcmp (arg, "--bench-cut")) { // not in usage()
+				bench_cut = true;
+				use_gui = false;
+			}
 			else
 				files.push_back (std::string (argv[i]));
 		}
@@ -280,7 +286,10 @@ int main(int argc, char **argv)
 	return 0;
       }
 
-      if (opts.gcode_output_path.size() > 0) {
+      if (opts.bench_cut) {
+	model->BenchmarkCutting();
+      }
+      else if (opts.gcode_output_path.size() > 0) {
 	model->ConvertToGCode();
         model->WriteGCode(Gio::File::create_for_path(opts.gcode_output_path));
       }
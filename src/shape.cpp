@@ -29,25 +29,77 @@
 #include <omp.h>
 #endif
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_AVX2_KERNEL 1
+#include <immintrin.h>
+#endif
+
 // Constructor
 Shape::Shape()
-  : slow_drawing(false), gl_List(-1)
+  : slow_drawing(false), geometry(new SharedMesh())
 {
   Min.set(0,0,0);
   Max.set(200,200,200);
   CalcBBox();
 }
 
+// the slicing data is built again when needed
+Shape::Shape(const Shape &other)
+  : filename(other.filename), idx(other.idx),
+    transform3D(other.transform3D),
+    Min(other.Min), Max(other.Max), Center(other.Center),
+    slow_drawing(other.slow_drawing), geometry(other.geometry)
+{
+}
+
+Shape &Shape::operator=(const Shape &other)
+{
+  if (this == &other) return *this;
+  filename = other.filename;
+  idx = other.idx;
+  transform3D = other.transform3D;
+  Min = other.Min; Max = other.Max; Center = other.Center;
+  slow_drawing = other.slow_drawing;
+  geometry = other.geometry;
+  zindex.clear();
+  world.clear();
+  topology.clear();
+  return *this;
+}
+
+Mesh &Shape::editMesh()
+{
+  if (geometry->isShared())
+    geometry = Glib::RefPtr<SharedMesh>(new SharedMesh(geometry->mesh));
+  else
+    geometry->clearList();
+  return geometry->mesh;
+}
+
 void Shape::clear() {
-  triangles.clear();
-  if (gl_List>=0)
-    glDeleteLists(gl_List,1);
-  gl_List = -1;
+  if (geometry->isShared()) // leave the others' mesh, no copy
+    geometry = Glib::RefPtr<SharedMesh>(new SharedMesh());
+  else
+    editMesh().clear();
+  zindex.clear();
+  world.clear();
+  topology.clear();
 };
 
 void Shape::setTriangles(const vector<Triangle> &triangles_)
 {
-  triangles = triangles_;
+  Mesh newmesh;
+  newmesh.setTriangles(triangles_);
+  setMesh(newmesh);
+}
+
+void Shape::setMesh(Mesh &mesh_)
+{
+  if (geometry->isShared()) // replaced anyway, no copy
+    geometry = Glib::RefPtr<SharedMesh>(new SharedMesh());
+  Mesh &m = editMesh();
+  m.clear();
+  m.swap(mesh_);
 
   CalcBBox();
   double vol = volume();
@@ -58,115 +110,63 @@ void Shape::setTriangles(const vector<Triangle> &triangles_)
 
   //PlaceOnPlatform();
   cerr << _("Shape has volume ") << volume() << _(" mm^3 and ")
-       << triangles.size() << _(" triangles") << endl;
+       << mesh().size() << _(" triangles") << endl;
 }
 
 
 int Shape::saveBinarySTL(Glib::ustring filename) const
 {
+  vector<Triangle> triangles;
+  mesh().getTriangles(triangles);
   if (!File::saveBinarySTL(filename, triangles, transform3D.transform))
     return -1;
   return 0;
 
 }
 
-bool Shape::hasAdjacentTriangleTo(const Triangle &triangle, double sqdistance) const
-{
-  bool haveadj = false;
-  int count = (int)triangles.size();
-#ifdef _OPENMP
-#pragma omp parallel for schedule(dynamic)
-#endif
-  for (int i = 0; i < count; i++)
-    if (!haveadj)
-      if (triangle.isConnectedTo(triangles[i],sqdistance)) {
-	haveadj = true;
-    }
-  return haveadj;
-}
-
-
-// recursively build a list of triangles for a shape
-void addtoshape(uint i, const vector< vector<uint> > &adj,
-		vector<uint> &tr, vector<bool> &done)
-{
-  if (!done[i]) {
-    // add this index to tr
-    tr.push_back(i);
-    done[i] = true;
-    for (uint j = 0; j < adj[i].size(); j++) {
-      if (adj[i][j]!=i)
-     	addtoshape(adj[i][j], adj, tr, done);
-    }
-  }
-  // we have a complete list of adjacent triangles indices
-}
-
+// Triangles belong to the same shape if they share a vertex, or have
+// vertices closer than 0.1mm (like Triangle::isConnectedTo(other, 0.01)).
+// Shapes are the components of a union-find over the mesh vertices.
 void Shape::splitshapes(vector<Shape*> &shapes, ViewProgress *progress)
 {
-  int n_tr = (int)triangles.size();
-  if (progress) progress->start(_("Split Shapes"), n_tr);
-  int progress_steps = max(1,(int)(n_tr/100));
-  vector<bool> done(n_tr);
-  bool cont = true;
-  // make list of adjacent triangles for each triangle
-  vector< vector<uint> > adj(n_tr);
+  const uint n_v = mesh().numVertices();
+  const uint n_tr = mesh().size();
+  if (progress) progress->start(_("Split Shapes"), n_v + n_tr);
+  const uint progress_steps = max(1u, (n_v + n_tr)/100);
+
   if (progress) progress->set_label(_("Split: Sorting Triangles ..."));
-#ifdef _OPENMP
-  omp_lock_t progress_lock;
-  omp_init_lock(&progress_lock);
-#pragma omp parallel for schedule(dynamic)
-#endif
-  for (int i = 0; i < n_tr; i++) {
-    if (progress && i%progress_steps==0) {
-#ifdef _OPENMP
-      omp_set_lock(&progress_lock);
-#endif
-      cont = progress->update(i);
-#ifdef _OPENMP
-      omp_unset_lock(&progress_lock);
-#endif
-    }
-    vector<uint> trv;
-    for (int j = 0; j < n_tr; j++) {
-      if (i!=j) {
-	bool add = false;
-	if (j<i) // maybe(!) we have it already
-	  for (uint k = 0; k<adj[j].size(); k++) {
-	    if ((int)adj[j][k] == i) {
-	      add = true; break;
-	    }
-	  }
-	add |= (triangles[i].isConnectedTo(triangles[j], 0.01));
-	if (add) trv.push_back(j);
-      }
-    }
-    adj[i] = trv;
-    if (!cont) i=n_tr;
+  UnionFind groups(n_v);
+  // faces join their vertices
+  for (uint f = 0; f < n_tr; f++) {
+    groups.unite(mesh().vertexIndex(f,0), mesh().vertexIndex(f,1));
+    groups.unite(mesh().vertexIndex(f,0), mesh().vertexIndex(f,2));
+  }
+  if (!mesh().uniteNearVertices(0.01, groups, progress)) {
+    if (progress) progress->stop("_(Done)");
+    return;
   }
 
   if (progress) progress->set_label(_("Split: Building shapes ..."));
-
-
-  // triangle indices of shapes
-  vector< vector<uint> > shape_tri;
-
-  for (int i = 0; i < n_tr; i++) done[i] = false;
-  for (int i = 0; i < n_tr; i++) {
-    if (progress && i%progress_steps==0)
-      cont = progress->update(i);
-    if (!done[i]){
-      cerr << _("Shape ") << shapes.size()+1 << endl;
-      vector<uint> current;
-      addtoshape(i, adj, current, done);
-      Shape *shape = new Shape();
-      shapes.push_back(shape);
-      shapes.back()->triangles.resize(current.size());
-      for (uint i = 0; i < current.size(); i++)
-	shapes.back()->triangles[i] = triangles[current[i]];
-      shapes.back()->CalcBBox();
+  // triangles of each shape, shapes in order of their first triangle
+  vector<int> shape_of(n_v, -1);
+  vector< vector<Triangle> > shape_triangles;
+  for (uint f = 0; f < n_tr; f++) {
+    if (progress && (n_v+f)%progress_steps == 0)
+      progress->update(n_v+f);
+    const uint root = groups.find(mesh().vertexIndex(f,0));
+    if (shape_of[root] < 0) {
+      shape_of[root] = shape_triangles.size();
+      shape_triangles.push_back(vector<Triangle>());
     }
-    if (!cont) i=n_tr;
+    shape_triangles[shape_of[root]].push_back(mesh().triangle(f));
+  }
+  for (uint s = 0; s < shape_triangles.size(); s++) {
+    cerr << _("Shape ") << shapes.size()+1 << endl;
+    Shape *shape = new Shape();
+    shapes.push_back(shape);
+    shape->editMesh().setTriangles(shape_triangles[s]);
+    shape->CalcBBox();
+    vector<Triangle>().swap(shape_triangles[s]);
   }
 
   if (progress) progress->stop("_(Done)");
@@ -206,51 +206,78 @@ void Shape::makeHollow(double wallthickness)
   const Vector3d wall(wallthickness,wallthickness,wallthickness);
   Matrix4d invT = transform3D.getInverse();
   vector<Triangle> cubet = cube(invT*Min-wall, invT*Max+wall);
-  triangles.insert(triangles.end(),cubet.begin(),cubet.end());
+  editMesh().addTriangles(cubet);
   CalcBBox();
 }
 
 void Shape::invertNormals()
 {
-  for (uint i = 0; i < triangles.size(); i++)
-    triangles[i].invertNormal();
+  editMesh().invertFaces();
+  world.clear();
+  topology.clear();
 }
 
-// doesn't work
-void Shape::repairNormals(double sqdistance)
+void Shape::repairMesh(double weld_distance, bool close_holes)
 {
-  for (uint i = 0; i < triangles.size(); i++) {
-    vector<uint> adjacent;
-    uint numadj=0, numwrong=0;
-    for (uint j = i+1; j < triangles.size(); j++) {
-      if (i!=j) {
-	if (triangles[i].isConnectedTo(triangles[j], sqdistance)) {
-	  numadj++;
-	  if (triangles[i].wrongOrientationWith(triangles[j], sqdistance)) {
-	    numwrong++;
-	    triangles[j].invertNormal();
-	  }
-	}
+  Mesh &m = editMesh();
+  uint welded = 0;
+  if (weld_distance > 0)
+    welded = m.weldVertices(weld_distance);
+  topology.build(m);
+  uint components, conflicts;
+  const uint flipped = topology.orientFaces(m, components, conflicts);
+  if (flipped > 0)
+    topology.build(m);
+  vector< vector<uint> > loops;
+  topology.boundaryLoops(m, loops);
+  if (close_holes) {
+    // triangle fans around the centers of the holes
+    for (uint l = 0; l < loops.size(); l++) {
+      const vector<uint> &loop = loops[l];
+      const uint n = loop.size();
+      if (n == 3) {
+	m.addFace(loop[0], loop[1], loop[2]);
+	continue;
       }
+      Vector3d center(0,0,0);
+      for (uint i = 0; i < n; i++) center += m.getVertex(loop[i]);
+      const uint c = m.addVertex(center / n);
+      for (uint i = 0; i < n; i++)
+	m.addFace(loop[i], loop[(i+1)%n], c);
     }
-    //cerr << i<< ": " << numadj << " - " << numwrong  << endl;
-    //if (numwrong > numadj/2) triangles[i].invertNormal();
   }
+  world.clear();
+  topology.clear();
+  if (welded > 0 || flipped > 0 || loops.size() > 0 || conflicts > 0)
+    cerr << _("Repair: welded ") << welded << _(" vertices, flipped ")
+	 << flipped << _(" triangles in ") << components << _(" parts, ")
+	 << conflicts << _(" edges with inconsistent winding, ")
+	 << loops.size() << (close_holes ? _(" holes closed") : _(" holes"))
+	 << endl;
+  CalcBBox();
+  if (volume() < 0)
+    invertNormals();
 }
 
 void Shape::mirror()
 {
   const Vector3d mCenter = transform3D.getInverse() * Center;
-  for (uint i = 0; i < triangles.size(); i++)
-    triangles[i].mirrorX(mCenter);
+  Mesh &m = editMesh();
+  // like Triangle::mirrorX
+  for (uint v = 0; v < m.numVertices(); v++) {
+    Vector3d p = m.getVertex(v);
+    p.x() = mCenter.x() - p.x();
+    m.setVertex(v, p);
+  }
+  m.invertFaces();
   CalcBBox();
 }
 
 double Shape::volume() const
 {
   double vol=0;
-  for (uint i = 0; i < triangles.size(); i++)
-    vol+=triangles[i].projectedvolume(transform3D.transform);
+  for (uint i = 0; i < mesh().size(); i++)
+    vol+=mesh().triangle(i).projectedvolume(transform3D.transform);
   return vol;
 }
 
@@ -258,24 +285,22 @@ string Shape::getSTLsolid() const
 {
   stringstream sstr;
   sstr << "solid " << filename <<endl;
-  for (uint i = 0; i < triangles.size(); i++)
-    sstr << triangles[i].getSTLfacet(transform3D.transform);
+  for (uint i = 0; i < mesh().size(); i++)
+    sstr << mesh().triangle(i).getSTLfacet(transform3D.transform);
   sstr << "endsolid " << filename <<endl;
   return sstr.str();
 }
 
 void Shape::addTriangles(const vector<Triangle> &tr)
 {
-  triangles.insert(triangles.end(), tr.begin(), tr.end());
+  editMesh().addTriangles(tr);
   CalcBBox();
 }
 
 vector<Triangle> Shape::getTriangles(const Matrix4d &T) const
 {
-  vector<Triangle> tr(triangles.size());
-  for (uint i = 0; i < triangles.size(); i++) {
-    tr[i] = triangles[i].transformed(T*transform3D.transform);
-  }
+  vector<Triangle> tr;
+  mesh().getTriangles(tr, T*transform3D.transform);
   return tr;
 }
 
@@ -283,11 +308,12 @@ vector<Triangle> Shape::getTriangles(const Matrix4d &T) const
 vector<Triangle> Shape::trianglesSteeperThan(double angle) const
 {
   vector<Triangle> tr;
-  for (uint i = 0; i < triangles.size(); i++) {
+  for (uint i = 0; i < mesh().size(); i++) {
+    const Triangle triangle = mesh().triangle(i);
     // negative angles are triangles facing downwards
-    const double tangle = -triangles[i].slopeAngle(transform3D.transform);
+    const double tangle = -triangle.slopeAngle(transform3D.transform);
     if (tangle >= angle)
-      tr.push_back(triangles[i]);
+      tr.push_back(triangle);
   }
   return tr;
 }
@@ -336,13 +362,78 @@ void Shape::CalcBBox()
 {
   Min.set(INFTY,INFTY,INFTY);
   Max.set(-INFTY,-INFTY,-INFTY);
-  for(size_t i = 0; i < triangles.size(); i++) {
-    triangles[i].AccumulateMinMax (Min, Max, transform3D.transform);
+  for(uint v = 0; v < mesh().numVertices(); v++) {
+    const Vector3d p = transform3D.transform * mesh().getVertex(v);
+    for (uint i = 0; i < 3; i++) {
+      Min[i] = MIN(p[i], Min[i]);
+      Max[i] = MAX(p[i], Max[i]);
+    }
   }
   Center = (Max + Min) / 2;
-  if (gl_List>=0)
-    glDeleteLists(gl_List,1);
-  gl_List = -1;
+  zindex.clear();
+  world.clear();
+  topology.clear();
+}
+
+void Shape::prepareSlicing(const Matrix4d &T)
+{
+  const Matrix4d transform = T * transform3D.transform;
+  if (!world.isValidFor(transform))
+    world.build(mesh(), transform);
+  if (!zindex.isValidFor(transform))
+    zindex.build(world, transform);
+  if (!topology.isValid())
+    topology.build(mesh());
+}
+
+void Shape::finishSlicing()
+{
+  world.clear();
+}
+
+void Shape::benchmarkCutting(const Matrix4d &T, double thickness, ostream &out) const
+{
+  const Matrix4d transform = T * transform3D.transform;
+  if (!world.isValidFor(transform) || thickness <= 0) return;
+  const uint count = mesh().size();
+  if (count == 0) return; // flat shapes have no faces
+  const double zmin = *std::min_element(world.minZ.begin(), world.minZ.end());
+  const double zmax = *std::max_element(world.maxZ.begin(), world.maxZ.end());
+  vector<int> num[3];
+  vector<Vector2d> starts[3], ends[3];
+  double used[3] = {0,0,0};
+  uint layers = 0, cuts = 0, mismatches = 0;
+  for (double z = zmin + thickness/2; z < zmax; z += thickness, layers++) {
+    Glib::TimeVal start, end;
+    // each triangle on its own
+    start.assign_current_time();
+    num[0].resize(count); starts[0].resize(count); ends[0].resize(count);
+    for (uint i = 0; i < count; i++)
+      num[0][i] = mesh().triangle(i).CutWithPlane(z, transform, starts[0][i], ends[0][i]);
+    end.assign_current_time();
+    used[0] += (end-start).as_double();
+    // batch, scalar and vectorised
+    for (uint k = 1; k < 3; k++) {
+      start.assign_current_time();
+      world.cutWithPlane(z, NULL, count, num[k], starts[k], ends[k], k == 2);
+      end.assign_current_time();
+      used[k] += (end-start).as_double();
+    }
+    for (uint i = 0; i < count; i++) {
+      if (num[0][i] > 0) cuts++;
+      for (uint k = 1; k < 3; k++)
+	if (num[k][i] != num[0][i] ||
+	    (num[0][i] > 0 && starts[k][i] != starts[0][i]) ||
+	    (num[0][i] > 1 && ends[k][i] != ends[0][i]))
+	  mismatches++;
+    }
+  }
+  out << "cut " << count << " triangles in " << layers << " layers, "
+      << cuts << " cuts, " << mismatches << " mismatches" << endl
+      << "  Triangle::CutWithPlane " << used[0] << "s" << endl
+      << "  batch scalar           " << used[1] << "s" << endl
+      << "  batch " << (WorldMesh::haveVectorKernel() ? "AVX2 " : "(no AVX2)")
+      << "          " << used[2] << "s" << endl;
 }
 
 Vector3d Shape::scaledCenter() const
@@ -350,74 +441,185 @@ Vector3d Shape::scaledCenter() const
   return Center * transform3D.get_scale();
 }
 
-struct SNorm {
-  Vector3d normal;
+// area weighted normals binned on the unit sphere by rounded components
+struct NormalBin {
+  int x, y, z;
   double area;
-  bool operator<(const SNorm &other) const {return (area<other.area);};
-} ;
+  Vector3d sum; // area weighted
+  bool operator<(const NormalBin &other) const {
+    if (x != other.x) return x < other.x;
+    if (y != other.y) return y < other.y;
+    return z < other.z;
+  };
+};
+static bool larger_area(const NormalBin &a, const NormalBin &b)
+{ return a.area > b.area; }
 
-vector<Vector3d> Shape::getMostUsedNormals() const
+// world space normals (not normalized, length is 2*area) of all faces
+static void world_normals(const Mesh &mesh, const Matrix4d &T,
+			  vector<Vector3d> &vertices, vector<Vector3d> &normals)
 {
-  vector<struct SNorm> normals;
-  // vector<Vector3d> normals;
-  // vector<double> area;
-  uint ntr = triangles.size();
-  vector<bool> done(ntr);
-  for(size_t i=0;i<ntr;i++) done[ntr] = false;
-  for(size_t i=0;i<ntr;i++)
-    {
-      bool havenormal = false;
-      int numnorm = normals.size();
+  const int nv = mesh.numVertices(), nf = mesh.size();
+  vertices.resize(nv);
+  normals.resize(nf);
 #ifdef _OPENMP
-#pragma omp parallel for schedule(dynamic)
+#pragma omp parallel for schedule(static)
 #endif
-      for (int n = 0; n < numnorm; n++) {
-	if ( (normals[n].normal -
-	      triangles[i].transformed(transform3D.transform).Normal)
-	     .squared_length() < 0.000001) {
-	  havenormal = true;
-	  normals[n].area += triangles[i].area();
-	  done[i] = true;
-	}
-      }
-      if (!havenormal){
-	SNorm n;
-	n.normal = triangles[i].transformed(transform3D.transform).Normal;
-	n.area = triangles[i].area();
-	normals.push_back(n);
-	done[i] = true;
-      }
-    }
-  std::sort(normals.rbegin(),normals.rend());
-  //cerr << normals.size() << endl;
-  vector<Vector3d> nv(normals.size());
-  for (uint n=0; n < normals.size(); n++) nv[n] = normals[n].normal;
-  return nv;
+  for (int v = 0; v < nv; v++)
+    vertices[v] = T * mesh.getVertex(v);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+  for (int f = 0; f < nf; f++) {
+    const Vector3d &A = vertices[mesh.vertexIndex(f,0)];
+    const Vector3d &B = vertices[mesh.vertexIndex(f,1)];
+    const Vector3d &C = vertices[mesh.vertexIndex(f,2)];
+    normals[f] = (C-A).cross(C-B);
+  }
+}
+
+// normals that differ by less than 1/resolution share a bin
+static void normal_histogram(const vector<Vector3d> &normals, double resolution,
+			     vector<NormalBin> &bins)
+{
+  const int nf = normals.size();
+  vector<NormalBin> all(nf);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+  for (int f = 0; f < nf; f++) {
+    const double len = normals[f].length();
+    NormalBin &b = all[f];
+    b.area = 0.5 * len;
+    b.sum = normals[f] * 0.5;
+    if (len > 0) {
+      b.x = (int)floor(normals[f].x()/len*resolution + 0.5);
+      b.y = (int)floor(normals[f].y()/len*resolution + 0.5);
+      b.z = (int)floor(normals[f].z()/len*resolution + 0.5);
+    } else
+      b.x = b.y = b.z = 0;
+  }
+  std::sort(all.begin(), all.end());
+  bins.clear();
+  for (int f = 0; f < nf; f++) {
+    if (all[f].area == 0) continue;
+    if (bins.size() > 0 && !(bins.back() < all[f])) {
+      bins.back().area += all[f].area;
+      bins.back().sum  += all[f].sum;
+    } else
+      bins.push_back(all[f]);
+  }
+  std::sort(bins.begin(), bins.end(), larger_area);
 }
 
+vector<Vector3d> Shape::getMostUsedNormals() const
+{
+  vector<Vector3d> vertices, normals;
+  world_normals(mesh(), transform3D.transform, vertices, normals);
+  vector<NormalBin> bins;
+  normal_histogram(normals, 1000., bins);
+  vector<Vector3d> nv(bins.size());
+  for (uint n = 0; n < bins.size(); n++) nv[n] = normalized(bins[n].sum);
+  return nv;
+}
 
-void Shape::OptimizeRotation()
+// Put the shape on the face direction with the largest contact area
+// with the platform: candidates are the 32 most used normal directions
+// and the current down direction. Contact faces point down within 1
+// degree and lie on the lowest plane.
+// With supportangle >= 0, among the candidates with at least half of the
+// best contact area the one with the least support volume (overhang
+// area like trianglesSteeperThan times height) is taken.
+void Shape::OptimizeRotation(double supportangle)
 {
-  // CenterAroundXY();
-  vector<Vector3d> normals = getMostUsedNormals();
-  // cycle through most-used normals?
+  const uint max_candidates = 32;
+  vector<Vector3d> vertices, normals;
+  world_normals(mesh(), transform3D.transform, vertices, normals);
+  vector<NormalBin> bins;
+  normal_histogram(normals, 200., bins);
+
+  vector<Vector3d> down(1, Vector3d(0,0,-1));
+  for (uint b = 0; b < bins.size() && down.size() <= max_candidates; b++)
+    down.push_back(normalized(bins[b].sum));
+  const int ncand = down.size();
+  const int nv = vertices.size(), nf = normals.size();
+
+  // lowest plane for every direction
+  vector<double> bottom(ncand, -INFTY);
+  for (int c = 0; c < ncand; c++) {
+    double lowest = -INFTY;
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+    {
+      double thread_lowest = -INFTY;
+#ifdef _OPENMP
+#pragma omp for schedule(static) nowait
+#endif
+      for (int v = 0; v < nv; v++)
+	thread_lowest = max(thread_lowest, vertices[v].dot(down[c]));
+#ifdef _OPENMP
+#pragma omp critical
+#endif
+      lowest = max(lowest, thread_lowest);
+    }
+    bottom[c] = lowest;
+  }
 
-  Vector3d N;
-  Vector3d Z(0,0,-1);
-  double angle=0;
-  int count = (int)normals.size();
-  for (int n=0; n < count; n++) {
-    //cerr << n << normals[n] << endl;
-    N = normals[n];
-    angle = acos(N.dot(Z));
-    if (angle>0) {
-      Vector3d axis = N.cross(Z);
-      if (axis.squared_length()>0.1) {
-	Rotate(axis,angle);
-	break;
+  const double contact_cos = cos(M_PI/180.);
+  const double support_sin = sin(supportangle);
+  vector<double> contact(ncand, 0.), support(ncand, 0.);
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+  {
+    vector<double> t_contact(ncand, 0.), t_support(ncand, 0.);
+#ifdef _OPENMP
+#pragma omp for schedule(static) nowait
+#endif
+    for (int f = 0; f < nf; f++) {
+      const double len = normals[f].length();
+      if (len == 0) continue;
+      const Vector3d &A = vertices[mesh().vertexIndex(f,0)];
+      const Vector3d &B = vertices[mesh().vertexIndex(f,1)];
+      const Vector3d &C = vertices[mesh().vertexIndex(f,2)];
+      for (int c = 0; c < ncand; c++) {
+	const double cosine = normals[f].dot(down[c]) / len;
+	if (cosine > contact_cos &&
+	    min(min(A.dot(down[c]), B.dot(down[c])), C.dot(down[c])) > bottom[c] - 0.01)
+	  t_contact[c] += 0.5 * len;
+	else if (supportangle >= 0 && cosine >= support_sin) {
+	  const double height = bottom[c] - (A+B+C).dot(down[c]) / 3.;
+	  t_support[c] += 0.5 * len * cosine * height;
+	}
       }
     }
+#ifdef _OPENMP
+#pragma omp critical
+#endif
+    for (int c = 0; c < ncand; c++) {
+      contact[c] += t_contact[c];
+      support[c] += t_support[c];
+    }
+  }
+
+  int best = 0;
+  for (int c = 1; c < ncand; c++)
+    if (contact[c] > contact[best]) best = c;
+  if (supportangle >= 0) {
+    const double min_contact = 0.5 * contact[best];
+    for (int c = 0; c < ncand; c++)
+      if (contact[c] >= min_contact && support[c] < support[best])
+	best = c;
   }
+
+  const Vector3d &N = down[best];
+  const Vector3d Z(0,0,-1);
+  const Vector3d axis = N.cross(Z);
+  if (axis.squared_length() > 1e-12)
+    Rotate(normalized(axis), acos(max(-1., min(1., N.dot(Z)))));
+  else if (N.dot(Z) < 0) // upside down
+    Rotate(Vector3d(1,0,0), M_PI);
   CalcBBox();
   PlaceOnPlatform();
 }
@@ -436,16 +638,17 @@ int Shape::divideAtZ(double z, Shape *upper, Shape *lower, const Matrix4d &T) co
   for (uint i=0; i<surfs.size(); i++)
     surf.insert(surf.end(), surfs[i].begin(), surfs[i].end());
 
-  lower->triangles.insert(lower->triangles.end(),surf.begin(),surf.end());
+  vector<Triangle> uppertr, lowertr;
+  lowertr.insert(lowertr.end(),surf.begin(),surf.end());
   for (guint i=0; i<surf.size(); i++) surf[i].invertNormal();
-  upper->triangles.insert(upper->triangles.end(),surf.begin(),surf.end());
+  uppertr.insert(uppertr.end(),surf.begin(),surf.end());
   vector<Triangle> toboth;
-  for (guint i=0; i< triangles.size(); i++) {
-    Triangle tt = triangles[i].transformed(T*transform3D.transform);
+  for (guint i=0; i< mesh().size(); i++) {
+    Triangle tt = mesh().triangle(i).transformed(T*transform3D.transform);
     if (tt.A.z() < z && tt.B.z() < z && tt.C.z() < z )
-      lower->triangles.push_back(tt);
+      lowertr.push_back(tt);
     else if (tt.A.z() > z && tt.B.z() > z && tt.C.z() > z )
-      upper->triangles.push_back(tt);
+      uppertr.push_back(tt);
     else
       toboth.push_back(tt);
   }
@@ -453,10 +656,10 @@ int Shape::divideAtZ(double z, Shape *upper, Shape *lower, const Matrix4d &T) co
   for (guint i=0; i< toboth.size(); i++) {
     toboth[i].SplitAtPlane(z, uppersplit, lowersplit);
   }
-  upper->triangles.insert(upper->triangles.end(),
-			 uppersplit.begin(),uppersplit.end());
-  lower->triangles.insert(lower->triangles.end(),
-			 lowersplit.begin(),lowersplit.end());
+  uppertr.insert(uppertr.end(), uppersplit.begin(),uppersplit.end());
+  lowertr.insert(lowertr.end(), lowersplit.begin(),lowersplit.end());
+  upper->addTriangles(uppertr);
+  lower->addTriangles(lowertr);
   upper->CalcBBox();
   lower->CalcBBox();
   lower->Rotate(Vector3d(0,1,0),M_PI);
@@ -495,19 +698,16 @@ void Shape::Twist(double angle)
 {
   CalcBBox();
   double h = Max.z()-Min.z();
-  double hangle=0;
   Vector3d axis(0,0,1);
-  int count = (int)triangles.size();
+  Mesh &m = editMesh();
+  int count = (int)m.numVertices();
 #ifdef _OPENMP
 #pragma omp parallel for schedule(dynamic)
 #endif
-  for (int i=0; i<count; i++) {
-    for (size_t j=0; j<3; j++)
-      {
-	hangle = angle * (triangles[i][j].z() - Min.z()) / h;
-	triangles[i][j] = triangles[i][j].rotate(hangle,axis);
-      }
-    triangles[i].calcNormal();
+  for (int v=0; v<count; v++) {
+    const Vector3d &p = m.getVertex(v);
+    const double hangle = angle * (p.z() - Min.z()) / h;
+    m.setVertex(v, p.rotate(hangle,axis));
   }
   CalcBBox();
 }
@@ -607,12 +807,19 @@ bool Shape::getPolygonsAtZ(const Matrix4d &T, double z,
 			   double &max_gradient,
 			   vector<Poly> &supportpolys,
 			   double max_supportangle,
-			   double thickness) const
+			   double thickness,
+			   const vector<uint> *triangle_indices) const
 {
-  vector<Vector2d> vertices;
   vector<Triangle> support_triangles;
+  // chain the contours through the mesh if we can, else match
+  // the cut segments geometrically
+  if (!topology.isManifold() ||
+      !getContoursAtZ(T, z, polys, max_gradient, support_triangles,
+		      max_supportangle, thickness, triangle_indices)) {
+  vector<Vector2d> vertices;
   vector<Segment> lines = getCutlines(T, z, vertices, max_gradient,
-				      support_triangles, max_supportangle, thickness);
+				      support_triangles, max_supportangle, thickness,
+				      triangle_indices);
   //cerr << vertices.size() << " " << lines.size() << endl;
   if (!CleanupSharedSegments(lines)) return false;
   //cerr << vertices.size() << " " << lines.size() << endl;
@@ -632,6 +839,7 @@ bool Shape::getPolygonsAtZ(const Matrix4d &T, double z,
     poly.calcHole();
     polys.push_back(poly);
   }
+  }
 
   for (uint i = 0; i < support_triangles.size(); i++) {
     Poly p(z);
@@ -689,87 +897,170 @@ bool Shape::getPolygonsAtZ(const Matrix4d &T, double z,
 }
 
 
-int find_vertex(const vector<Vector2d> &vertices,
-		const Vector2d &v, double delta = 0.0001)
+// faces of a mesh transformed on the fly, like a WorldMesh
+struct TransformedFaces {
+  const Mesh &mesh;
+  const Matrix4d &T;
+  TransformedFaces(const Mesh &mesh_, const Matrix4d &T_) : mesh(mesh_), T(T_) {};
+  int cutWithPlane(uint face, double z, Vector2d &lineStart, Vector2d &lineEnd) const
+  { return mesh.triangle(face).CutWithPlane(z, T, lineStart, lineEnd); };
+  void cutWithPlane(double z, const vector<uint> *faces, uint count,
+		    vector<int> &num_cutpoints,
+		    vector<Vector2d> &lineStarts, vector<Vector2d> &lineEnds) const
+  {
+    num_cutpoints.resize(count);
+    lineStarts.resize(count);
+    lineEnds.resize(count);
+    for (uint c = 0; c < count; c++)
+      num_cutpoints[c] = cutWithPlane(faces ? (*faces)[c] : c, z,
+				      lineStarts[c], lineEnds[c]);
+  };
+  bool isInZrange(uint face, double zmin, double zmax) const
+  { return mesh.triangle(face).isInZrange(zmin, zmax, T); };
+  double slopeAngle(uint face) const { return mesh.triangle(face).slopeAngle(T); };
+  double gradient(uint face) const { return abs(mesh.normal(face).z()); };
+  Triangle transformed(uint face) const { return mesh.triangle(face).transformed(T); };
+};
+
+// gradient and support triangles of a face, cut at z or not
+template <class Faces>
+static void check_support_face(const Faces &faces, uint face,
+			       bool cut, double z,
+			       double supportangle, double thickness,
+			       double &max_gradient,
+			       vector<Triangle> &support_triangles)
 {
-  int found = -1;
-  int count = (int)vertices.size();
-#ifdef _OPENMP
-#pragma omp parallel for schedule(dynamic)
-#endif
-  for (int i=0; i<count; i++) {
-    if (found != -1) continue;
-    if ( (v-vertices[i]).squared_length() < delta ) {
-      found = i;
-#ifndef _OPENMP
-      break;
-#endif
+  if (!cut) {
+    if (supportangle >= 0 && thickness > 0) {
+      if (faces.isInZrange(face, z-thickness, z)) {
+	const double slope = -faces.slopeAngle(face);
+	if (slope >= supportangle) {
+	  support_triangles.push_back(faces.transformed(face));
+	}
+      }
     }
+    return;
+  }
+  const double gradient = faces.gradient(face);
+  if (gradient > max_gradient)
+    max_gradient = gradient;
+  if (supportangle >= 0) {
+    const double slope = -faces.slopeAngle(face);
+    if (slope >= supportangle)
+      support_triangles.push_back(faces.transformed(face));
   }
-  return found;
 }
 
-vector<Segment> Shape::getCutlines(const Matrix4d &T, double z,
-				   vector<Vector2d> &vertices,
-				   double &max_gradient,
-				   vector<Triangle> &support_triangles,
-				   double supportangle,
-				   double thickness) const
+const vector<uint> *Shape::nearTriangles(const Matrix4d &transform, double z,
+					 double supportangle, double thickness,
+					 const vector<uint> *triangle_indices,
+					 vector<uint> &storage) const
 {
-  Vector2d lineStart;
-  Vector2d lineEnd;
-  vector<Segment> lines;
-  // we know our own tranform:
-  Matrix4d transform = T * transform3D.transform ;
+  // only look at triangles near z if given by the caller
+  // or if we have an index for this transform
+  if (triangle_indices == NULL && zindex.isValidFor(transform)) {
+    const double zmin = (supportangle >= 0 && thickness > 0) ? z-thickness : z;
+    zindex.getTriangles(zmin, z, storage);
+    return &storage;
+  }
+  return triangle_indices;
+}
 
-  int count = (int)triangles.size();
+bool Shape::getContoursAtZ(const Matrix4d &T, double z,
+			   vector<Poly> &polys, double &max_gradient,
+			   vector<Triangle> &support_triangles,
+			   double supportangle,
+			   double thickness,
+			   const vector<uint> *triangle_indices) const
+{
+  const Matrix4d transform = T * transform3D.transform;
+  if (!world.isValidFor(transform)) return false;
+  vector<uint> candidates;
+  triangle_indices = nearTriangles(transform, z, supportangle, thickness,
+				   triangle_indices, candidates);
+  if (triangle_indices == NULL) {
+    candidates.resize(mesh().size());
+    for (uint i = 0; i < candidates.size(); i++) candidates[i] = i;
+    triangle_indices = &candidates;
+  }
+  vector<uint> cutfaces;
+  vector< vector<Vector2d> > contours;
+  if (!topology.getContours(world, z, *triangle_indices, cutfaces, contours))
+    return false;
+  for (uint i = 0; i < contours.size(); i++) {
+    Poly poly(z);
+    for (uint j = 0; j < contours[i].size(); j++)
+      poly.addVertex(contours[i][j]);
+    poly.calcHole();
+    polys.push_back(poly);
+  }
+  // both lists are ascending
+  uint nextcut = 0;
+  for (uint c = 0; c < triangle_indices->size(); c++) {
+    const uint i = (*triangle_indices)[c];
+    const bool cut = (nextcut < cutfaces.size() && cutfaces[nextcut] == i);
+    if (cut) nextcut++;
+    check_support_face(world, i, cut, z, supportangle, thickness,
+		       max_gradient, support_triangles);
+  }
+  return true;
+}
+
+// add v to the vertices unless there is one closer than sqrt(delta) already,
+// returns its index
+static int weld_vertex(vector<Vector2d> &vertices, PointHash2D &hash,
+		       const Vector2d &v, double delta = 0.0001)
+{
+  const int found = hash.findPoint(v, delta);
+  if (found >= 0) return found;
+  const int index = vertices.size();
+  vertices.push_back(v);
+  hash.insert(index, v);
+  return index;
+}
+
+// cut the faces at z and join their cut points closer than 0.01
+template <class Faces>
+static vector<Segment> cut_faces(const Faces &faces, double z,
+				 const vector<uint> *triangle_indices, int count,
+				 vector<Vector2d> &vertices,
+				 double &max_gradient,
+				 vector<Triangle> &support_triangles,
+				 double supportangle,
+				 double thickness)
+{
+  vector<Segment> lines;
+  // cut all faces first
+  vector<int> cutpoints;
+  vector<Vector2d> lineStarts, lineEnds;
+  faces.cutWithPlane(z, triangle_indices, count, cutpoints, lineStarts, lineEnds);
+  // cells as wide as the welding distance of 0.01
+  PointHash2D vertexhash(0.01, count/4);
 // #ifdef _OPENMP
 // #pragma omp parallel for schedule(dynamic)
 // #endif
-  for (int i = 0; i < count; i++)
+  for (int c = 0; c < count; c++)
     {
+      const int i = triangle_indices ? (*triangle_indices)[c] : c;
       Segment line(-1,-1);
-      int num_cutpoints = triangles[i].CutWithPlane(z, transform, lineStart, lineEnd);
-      if (num_cutpoints == 0) {
-	if (supportangle >= 0 && thickness > 0) {
-	  if (triangles[i].isInZrange(z-thickness, z, transform)) {
-	    const double slope = -triangles[i].slopeAngle(transform);
-	    if (slope >= supportangle) {
-	      support_triangles.push_back(triangles[i].transformed(transform));
-	    }
-	  }
-	}
+      const Vector2d &lineStart = lineStarts[c];
+      const Vector2d &lineEnd = lineEnds[c];
+      int num_cutpoints = cutpoints[c];
+      check_support_face(faces, i, num_cutpoints > 0,
+			 z, supportangle, thickness,
+			 max_gradient, support_triangles);
+      if (num_cutpoints == 0)
 	continue;
-      }
       if (num_cutpoints > 0) {
-	int havev = find_vertex(vertices, lineStart);
-	if (havev >= 0)
-	  line.start = havev;
-	else {
-	  line.start = vertices.size();
-	  vertices.push_back(lineStart);
-	}
-	if (abs(triangles[i].Normal.z()) > max_gradient)
-	  max_gradient = abs(triangles[i].Normal.z());
-	if (supportangle >= 0) {
-	  const double slope = -triangles[i].slopeAngle(transform);
-	  if (slope >= supportangle)
-	    support_triangles.push_back(triangles[i].transformed(transform));
-	}
+	line.start = weld_vertex(vertices, vertexhash, lineStart);
       }
       if (num_cutpoints > 1) {
-	int havev = find_vertex(vertices, lineEnd);
-	if (havev >= 0)
-	  line.end = havev;
-	else {
-	  line.end = vertices.size();
-	  vertices.push_back(lineEnd);
-	}
+	line.end = weld_vertex(vertices, vertexhash, lineEnd);
       }
       // Check segment normal against triangle normal. Flip segment, as needed.
       if (line.start != -1 && line.end != -1 && line.end != line.start)
 	{ // if we found a intersecting triangle
-	  Vector3d Norm = triangles[i].transformed(transform).Normal;
+	  Vector3d Norm = faces.transformed(i).Normal;
 	  Vector2d triangleNormal = Vector2d(Norm.x(), Norm.y());
 	  Vector2d segment = (lineEnd - lineStart);
 	  Vector2d segmentNormal(-segment.y(),segment.x());
@@ -786,6 +1077,29 @@ vector<Segment> Shape::getCutlines(const Matrix4d &T, double z,
   return lines;
 }
 
+vector<Segment> Shape::getCutlines(const Matrix4d &T, double z,
+				   vector<Vector2d> &vertices,
+				   double &max_gradient,
+				   vector<Triangle> &support_triangles,
+				   double supportangle,
+				   double thickness,
+				   const vector<uint> *triangle_indices) const
+{
+  // we know our own tranform:
+  Matrix4d transform = T * transform3D.transform ;
+
+  vector<uint> candidates;
+  triangle_indices = nearTriangles(transform, z, supportangle, thickness,
+				   triangle_indices, candidates);
+  int count = triangle_indices ? (int)triangle_indices->size() : (int)mesh().size();
+  // use the world space copy if we have one for this transform
+  if (world.isValidFor(transform))
+    return cut_faces(world, z, triangle_indices, count, vertices,
+		     max_gradient, support_triangles, supportangle, thickness);
+  return cut_faces(TransformedFaces(mesh(), transform), z, triangle_indices, count,
+		   vertices, max_gradient, support_triangles, supportangle, thickness);
+}
+
 
 // called from Model::draw
 void Shape::draw(const Settings &settings, bool highlight, uint max_triangles)
@@ -857,14 +1171,15 @@ void Shape::draw(const Settings &settings, bool highlight, uint max_triangles)
 		glMaterialfv(GL_FRONT, GL_DIFFUSE, mat_diffuse);
 
 		glColor4fv(mat_diffuse);
-		for(size_t i=0;i<triangles.size();i++)
+		for(uint i=0;i<mesh().size();i++)
 		{
 			glBegin(GL_LINE_LOOP);
 			glLineWidth(1);
-			glNormal3dv((GLdouble*)&(triangles[i].Normal));
-			glVertex3dv((GLdouble*)&(triangles[i].A));
-			glVertex3dv((GLdouble*)&(triangles[i].B));
-			glVertex3dv((GLdouble*)&(triangles[i].C));
+			const Vector3d normal = mesh().normal(i);
+			glNormal3dv((GLdouble*)&normal);
+			glVertex3dv((GLdouble*)&(mesh().vertex(i,0)));
+			glVertex3dv((GLdouble*)&(mesh().vertex(i,1)));
+			glVertex3dv((GLdouble*)&(mesh().vertex(i,2)));
 			glEnd();
 		}
 	}
@@ -877,11 +1192,11 @@ void Shape::draw(const Settings &settings, bool highlight, uint max_triangles)
 	        glColor4fv(settings.get_colour("Display","NormalsColour"));
 		glBegin(GL_LINES);
 		double nlength = settings.get_double("Display","NormalsLength");
-		for(size_t i=0;i<triangles.size();i++)
+		for(uint i=0;i<mesh().size();i++)
 		{
-			Vector3d center = (triangles[i].A+triangles[i].B+triangles[i].C)/3.0;
+			Vector3d center = (mesh().vertex(i,0)+mesh().vertex(i,1)+mesh().vertex(i,2))/3.0;
 			glVertex3dv((GLdouble*)&center);
-			Vector3d N = center + (triangles[i].Normal*nlength);
+			Vector3d N = center + (mesh().normal(i)*nlength);
 			glVertex3dv((GLdouble*)&N);
 		}
 		glEnd();
@@ -893,12 +1208,8 @@ void Shape::draw(const Settings &settings, bool highlight, uint max_triangles)
       	        glColor4fv(settings.get_colour("Display","EndpointsColour"));
 		glPointSize(settings.get_double("Display","EndPointSize"));
 		glBegin(GL_POINTS);
-		for(size_t i=0;i<triangles.size();i++)
-		{
-		  glVertex3dv((GLdouble*)&(triangles[i].A));
-		  glVertex3dv((GLdouble*)&(triangles[i].B));
-		  glVertex3dv((GLdouble*)&(triangles[i].C));
-		}
+		for(uint v=0;v<mesh().numVertices();v++)
+		  glVertex3dv((GLdouble*)&(mesh().getVertex(v)));
 		glEnd();
 	}
 	glDisable(GL_DEPTH_TEST);
@@ -971,12 +1282,11 @@ void Shape::draw_geometry(uint max_triangles)
 {
 
   bool listDraw = (max_triangles == 0); // not in preview mode
+  int &gl_List = geometry->gl_List; // shared by all copies
   bool haveList = gl_List >= 0;
 
   if (!listDraw && haveList) {
-    if (gl_List>=0)
-      glDeleteLists(gl_List,1);
-    gl_List = -1;
+    geometry->clearList();
     haveList = false;
   }
   if (listDraw && !haveList) {
@@ -985,16 +1295,16 @@ void Shape::draw_geometry(uint max_triangles)
   }
   if (!listDraw || !haveList) {
 	uint step = 1;
-	if (max_triangles>0) step = floor(triangles.size()/max_triangles);
+	if (max_triangles>0) step = floor(mesh().size()/max_triangles);
 	step = max((uint)1,step);
 
 	glBegin(GL_TRIANGLES);
-	for(size_t i=0;i<triangles.size();i+=step)
+	for(uint i=0;i<mesh().size();i+=step)
 	{
-		glNormal3dv(triangles[i].Normal);
-		glVertex3dv(triangles[i].A);
-		glVertex3dv(triangles[i].B);
-		glVertex3dv(triangles[i].C);
+		glNormal3dv(mesh().normal(i));
+		glVertex3dv(mesh().vertex(i,0));
+		glVertex3dv(mesh().vertex(i,1));
+		glVertex3dv(mesh().vertex(i,2));
 	}
 	glEnd();
   }
@@ -1023,37 +1333,26 @@ void Shape::draw_geometry(uint max_triangles)
  * LinkSegments, so try to identify and join those polygons
  * now.
  */
-// ??? as only coincident lines are removed, couldn't this be
-// done easier by just running through all lines and finding them?
+// As only coincident lines are removed, sort the lines by their
+// (unordered) vertex pair and keep only the last one of each run.
 bool CleanupSharedSegments(vector<Segment> &lines)
 {
 #if 1 // just remove coincident lines
-  vector<int> lines_to_delete;
-  int count = (int)lines.size();
-#ifdef _OPENMP
-  //#pragma omp parallel for schedule(dynamic)
-#endif
-  for (int j = 0; j < count; j++) {
-    const Segment &jr = lines[j];
-    for (uint k = j + 1; k < lines.size(); k++)
-      {
-	const Segment &kr = lines[k];
-	if ((jr.start == kr.start && jr.end == kr.end) ||
-	    (jr.end == kr.start && jr.start == kr.end))
-	  {
-	    lines_to_delete.push_back (j);  // remove both???
-	    //lines_to_delete.push_back (k);
-	    break;
-	  }
-      }
-  }
-  // we need to remove from the end first to avoid disturbing
-  // the order of removed items
-  std::sort(lines_to_delete.begin(), lines_to_delete.end());
-  for (int r = lines_to_delete.size() - 1; r >= 0; r--)
-    {
-      lines.erase(lines.begin() + lines_to_delete[r]);
-    }
+  const uint count = lines.size();
+  vector< pair< pair<int,int>, uint > > keys(count);
+  for (uint j = 0; j < count; j++)
+    keys[j] = make_pair(make_pair(min(lines[j].start, lines[j].end),
+				  max(lines[j].start, lines[j].end)), j);
+  std::sort(keys.begin(), keys.end());
+  vector<bool> delete_line(count, false);
+  for (uint j = 1; j < count; j++)
+    if (keys[j].first == keys[j-1].first)
+      delete_line[keys[j-1].second] = true; // a later one is coincident
+  uint kept = 0;
+  for (uint j = 0; j < count; j++)
+    if (!delete_line[j])
+      lines[kept++] = lines[j];
+  lines.resize(kept, Segment(0,0));
   return true;
 
 #endif
@@ -1121,6 +1420,16 @@ bool CleanupSharedSegments(vector<Segment> &lines)
 #endif
 }
 
+// accepts detached points of a different type than the given one
+struct OtherVertexType {
+  const vector<int> &points;
+  const vector<int> &types;
+  int type;
+  OtherVertexType(const vector<int> &points_, const vector<int> &types_, int type_)
+    : points(points_), types(types_), type(type_) {};
+  bool operator()(uint i) const { return types[points[i]] != type; };
+};
+
 /*
  * Unfortunately, finding connections via co-incident points detected by
  * the PointHash is not perfect. For reasons unknown (probably rounding
@@ -1172,39 +1481,35 @@ bool CleanupConnectSegments(const vector<Vector2d> &vertices, vector<Segment> &l
 
 	// pair them nicely to their matching type
 	count = detached_points.size();
-// #ifdef _OPENMP
-// #pragma omp parallel for schedule(dynamic)
-// #endif
+	if (count == 0) return true;
+	// cells sized for about one point each
+	double minx = vertices[detached_points[0]].x(), maxx = minx;
+	double miny = vertices[detached_points[0]].y(), maxy = miny;
+	for (int i = 1; i < count; i++) {
+		const Vector2d &p = vertices[detached_points[i]];
+		minx = min(minx, p.x()); maxx = max(maxx, p.x());
+		miny = min(miny, p.y()); maxy = max(maxy, p.y());
+	}
+	PointHash2D hash(max(max(maxx-minx, maxy-miny) / sqrt((double)count), 0.01),
+			 count);
+	for (int i = 0; i < count; i++)
+		hash.insert(i, vertices[detached_points[i]]);
 	for (int i = 0; i < count; i++)
 	{
-		double nearest_dist_sq = (std::numeric_limits<double>::max)();
-		uint   nearest = 0;
+		double nearest_dist_sq;
 		int   n = detached_points[i]; // vertex index of detached point i
 		if (n < 0) // handled already
 		  continue;
 
 		const Vector2d &p = vertices[n]; // the real detached point
-		// find nearest other detached point to the detached point n:
-		for (int j = i + 1; j < count; j++)
-		{
-		        int pt = detached_points[j];
-			if (pt < 0)
-			  continue; // already connected
-
-			// don't connect a start to a start, or end to end
-			if (vertex_types[n] == vertex_types[pt])
-			        continue;
-
-			const Vector2d &q = vertices[pt];  // the real other point
-			double dist_sq = (p-q).squared_length(); //pow (p.x() - q.x(), 2) + pow (p.y() - q.y(), 2);
-			if (dist_sq < nearest_dist_sq)
-			{
-				nearest_dist_sq = dist_sq;
-				nearest = j;
-			}
-		}
-		//assert (nearest != 0);
-		if (nearest == 0) continue;
+		// only later points are left in the hash
+		hash.remove(i, p);
+		// find nearest other detached point to the detached point n,
+		// don't connect a start to a start, or end to end
+		const int nearest =
+		  hash.findNearest(p, OtherVertexType(detached_points, vertex_types, vertex_types[n]),
+				   nearest_dist_sq);
+		if (nearest < 0) continue;
 
 		// allow points 10mm apart to be joined, not more
 		if (!connect_all && nearest_dist_sq > 100.0) {
@@ -1223,6 +1528,7 @@ bool CleanupConnectSegments(const vector<Vector2d> &vertices, vector<Segment> &l
 		if (vertex_types[n] > 0) // already had start but no end at this point
 			seg.Swap();
 		lines.push_back(seg);
+		hash.remove(nearest, vertices[detached_points[nearest]]);
 		detached_points[nearest] = -1;
 	}
 
@@ -1230,10 +1536,676 @@ bool CleanupConnectSegments(const vector<Vector2d> &vertices, vector<Segment> &l
 }
 
 
+PointHash2D::PointHash2D(double cellsize_, uint expected_size)
+  : cellsize(cellsize_), count(0)
+{
+  uint n = 16;
+  while (n < 2*expected_size) n <<= 1;
+  buckets.resize(n, -1);
+  entries.reserve(expected_size);
+}
+
+void PointHash2D::clear()
+{
+  entries.clear();
+  unused.clear();
+  std::fill(buckets.begin(), buckets.end(), -1);
+  count = 0;
+  columns.clear();
+  rows.clear();
+}
+
+void PointHash2D::rehash(uint nbuckets)
+{
+  buckets.assign(nbuckets, -1);
+  for (int e = 0; e < (int)entries.size(); e++) {
+    if (entries[e].next == -2) continue; // unused
+    const uint b = bucket(cell(entries[e].p.x()), cell(entries[e].p.y()));
+    entries[e].next = buckets[b];
+    buckets[b] = e;
+  }
+}
+
+void PointHash2D::insert(uint index, const Vector2d &p)
+{
+  if (count + 1 > buckets.size() / 2)
+    rehash(buckets.size() * 2);
+  const int cx = cell(p.x()), cy = cell(p.y());
+  columns[cx]++;
+  rows[cy]++;
+  int e;
+  if (unused.size() > 0) {
+    e = unused.back();
+    unused.pop_back();
+  } else {
+    e = entries.size();
+    entries.push_back(Entry());
+  }
+  const uint b = bucket(cx, cy);
+  entries[e].p = p;
+  entries[e].index = index;
+  entries[e].next = buckets[b];
+  buckets[b] = e;
+  count++;
+}
+
+// drop an emptied column or row from the occupied ones
+static void decrement_cells(std::map<int,uint> &cells, int c)
+{
+  std::map<int,uint>::iterator it = cells.find(c);
+  if (it != cells.end() && --(it->second) == 0)
+    cells.erase(it);
+}
+
+void PointHash2D::remove(uint index, const Vector2d &p)
+{
+  const int cx = cell(p.x()), cy = cell(p.y());
+  int *link = &buckets[bucket(cx, cy)];
+  while (*link >= 0) {
+    Entry &en = entries[*link];
+    if (en.index == index) {
+      const int e = *link;
+      *link = en.next;
+      en.next = -2;
+      unused.push_back(e);
+      count--;
+      decrement_cells(columns, cx);
+      decrement_cells(rows, cy);
+      return;
+    }
+    link = &en.next;
+  }
+}
+
+int PointHash2D::findPoint(const Vector2d &p, double sqdistance) const
+{
+  int found = -1;
+  const int cx = cell(p.x()), cy = cell(p.y());
+  for (int x = cx - 1; x <= cx + 1; x++)
+    for (int y = cy - 1; y <= cy + 1; y++)
+      for (int e = buckets[bucket(x, y)]; e >= 0; e = entries[e].next) {
+	const Entry &en = entries[e];
+	if ((found < 0 || (int)en.index < found)
+	    && (en.p - p).squared_length() < sqdistance)
+	  found = en.index;
+      }
+  return found;
+}
+
+
+// sort triangle indices by their minimum z
+struct MinZLess {
+  const vector<double> &minZ;
+  MinZLess(const vector<double> &minZ_) : minZ(minZ_) {};
+  bool operator()(uint a, uint b) const { return minZ[a] < minZ[b]; };
+  bool operator()(uint a, double z) const { return minZ[a] < z; };
+  bool operator()(double z, uint b) const { return z < minZ[b]; };
+};
+
+void TriangleZIndex::clear()
+{
+  valid = false;
+  minZ.clear();
+  maxZ.clear();
+  byMinZ.clear();
+  level_start.clear();
+  slab_start.clear();
+  entries.clear();
+}
+
+void TriangleZIndex::build(const WorldMesh &world, const Matrix4d &T)
+{
+  clear();
+  const uint count = world.size();
+  minZ = world.minZ;
+  maxZ = world.maxZ;
+  double zmin = INFTY, zmax = -INFTY, sumheight = 0;
+  for (uint i = 0; i < count; i++) {
+    zmin = min(zmin, minZ[i]);
+    zmax = max(zmax, maxZ[i]);
+    sumheight += maxZ[i] - minZ[i];
+  }
+  transform = T;
+  valid = true;
+  if (count == 0) return;
+
+  byMinZ.resize(count);
+  for (uint i = 0; i < count; i++)
+    byMinZ[i] = i;
+  std::stable_sort(byMinZ.begin(), byMinZ.end(), MinZLess(minZ));
+
+  // level 0 slabs are as high as an average triangle, but there are
+  // not more slabs than triangles
+  const double height = zmax - zmin;
+  base_z = zmin;
+  base_height = max(sumheight / count, height / count);
+  if (base_height <= 0) base_height = 1.;
+  uint numlevels = 1;
+  while (base_height * (1 << (numlevels-1)) < height && numlevels < 31)
+    numlevels++;
+
+  level_start.resize(numlevels+1);
+  level_start[0] = 0;
+  for (uint l = 0; l < numlevels; l++)
+    level_start[l+1] = level_start[l] +
+      (uint)floor(height / (base_height * (1 << l))) + 1;
+
+  // every triangle goes into the lowest level with slabs as high as itself
+  vector<uint> slab(count);
+  for (uint i = 0; i < count; i++) {
+    uint l = 0;
+    while (maxZ[i] - minZ[i] > base_height * (1 << l) && l < numlevels-1)
+      l++;
+    const double w = base_height * (1 << l);
+    const uint nslabs = level_start[l+1] - level_start[l];
+    slab[i] = level_start[l] +
+      min(nslabs-1, (uint)max(0., floor((minZ[i] - base_z) / w)));
+  }
+  slab_start.assign(level_start[numlevels]+1, 0);
+  for (uint i = 0; i < count; i++)
+    slab_start[slab[i]+1]++;
+  for (uint s = 1; s < slab_start.size(); s++)
+    slab_start[s] += slab_start[s-1];
+  entries.resize(count);
+  vector<uint> fill(slab_start.begin(), slab_start.end()-1);
+  for (uint i = 0; i < count; i++)
+    entries[fill[slab[i]]++] = i;
+}
+
+void TriangleZIndex::getTriangles(double zmin, double zmax,
+				  vector<uint> &indices) const
+{
+  indices.clear();
+  if (!valid || entries.size() == 0) return;
+  const uint numlevels = level_start.size()-1;
+  for (uint l = 0; l < numlevels; l++) {
+    const double w = base_height * (1 << l);
+    const int nslabs = level_start[l+1] - level_start[l];
+    // triangles are at most w high, so they start above zmin-w
+    int first = (int)floor((zmin - w - base_z) / w);
+    int last  = (int)floor((zmax - base_z) / w);
+    first = max(0, first);
+    last  = min(nslabs-1, last);
+    for (int s = first; s <= last; s++) {
+      const uint gs = level_start[l] + s;
+      for (uint e = slab_start[gs]; e < slab_start[gs+1]; e++) {
+	const uint i = entries[e];
+	if (minZ[i] <= zmax && maxZ[i] >= zmin)
+	  indices.push_back(i);
+      }
+    }
+  }
+  std::sort(indices.begin(), indices.end());
+}
+
+
+TriangleSweep::TriangleSweep(const TriangleZIndex &index_)
+  : index(&index_), started(false), next(0)
+{
+}
+
+const vector<uint> &TriangleSweep::advance(double zmin, double zmax)
+{
+  const vector<uint> &byMinZ = index->byMinZ;
+  if (!started) {
+    // first window: take its triangles from the index and continue
+    // with the first triangle starting above it
+    index->getTriangles(zmin, zmax, active);
+    next = std::upper_bound(byMinZ.begin(), byMinZ.end(), zmax,
+			    MinZLess(index->minZ)) - byMinZ.begin();
+    started = true;
+    return active;
+  }
+  // triangles starting in the window enter
+  bool changed = false;
+  while (next < byMinZ.size() && index->minZ[byMinZ[next]] <= zmax) {
+    active.push_back(byMinZ[next]);
+    next++;
+    changed = true;
+  }
+  // triangles ending below the window leave
+  uint kept = 0;
+  for (uint a = 0; a < active.size(); a++)
+    if (index->maxZ[active[a]] >= zmin)
+      active[kept++] = active[a];
+  active.resize(kept);
+  if (changed)
+    std::sort(active.begin(), active.end());
+  return active;
+}
+
+
+void WorldMesh::clear()
+{
+  valid = false;
+  vx.clear(); vy.clear(); vz.clear();
+  indices.clear();
+  minZ.clear(); maxZ.clear();
+  slope.clear(); grad.clear();
+}
+
+void WorldMesh::build(const Mesh &mesh, const Matrix4d &T)
+{
+  clear();
+  const uint nvertices = mesh.numVertices();
+  vx.resize(nvertices); vy.resize(nvertices); vz.resize(nvertices);
+  for (uint v = 0; v < nvertices; v++) {
+    const Vector3d p = T * mesh.getVertex(v);
+    vx[v] = p.x(); vy[v] = p.y(); vz[v] = p.z();
+  }
+  const uint nfaces = mesh.size();
+  indices.resize(3*nfaces);
+  minZ.resize(nfaces); maxZ.resize(nfaces);
+  slope.resize(nfaces); grad.resize(nfaces);
+  for (uint i = 0; i < nfaces; i++) {
+    for (uint k = 0; k < 3; k++)
+      indices[3*i+k] = mesh.vertexIndex(i,k);
+    const double za = vz[indices[3*i]], zb = vz[indices[3*i+1]], zc = vz[indices[3*i+2]];
+    minZ[i] = min(za, min(zb, zc));
+    maxZ[i] = max(za, max(zb, zc));
+    const Triangle triangle = mesh.triangle(i);
+    slope[i] = triangle.slopeAngle(T);
+    grad[i] = abs(triangle.Normal.z());
+  }
+  transform = T;
+  valid = true;
+}
+
+Triangle WorldMesh::transformed(uint face) const
+{
+  const uint a = indices[3*face], b = indices[3*face+1], c = indices[3*face+2];
+  return Triangle(Vector3d(vx[a], vy[a], vz[a]),
+		  Vector3d(vx[b], vy[b], vz[b]),
+		  Vector3d(vx[c], vy[c], vz[c]));
+}
+
+Vector2d WorldMesh::cutPoint(uint a, uint b, double z) const
+{
+  const double t = (z - vz[a])/(vz[b] - vz[a]);
+  return Vector2d(vx[a] + (vx[b] - vx[a]) * t,
+		  vy[a] + (vy[b] - vy[a]) * t);
+}
+
+// Triangle::CutWithPlane on the transformed vertices
+int WorldMesh::cutWithPlane(uint face, double z,
+			    Vector2d &lineStart, Vector2d &lineEnd) const
+{
+  const uint a = indices[3*face], b = indices[3*face+1], c = indices[3*face+2];
+  const bool above_a = (z <= vz[a]), above_b = (z <= vz[b]), above_c = (z <= vz[c]);
+  int num_cutpoints = 0;
+  if (above_a != above_b) {
+    lineStart = cutPoint(a, b, z);
+    num_cutpoints = 1;
+  }
+  if (above_b != above_c) {
+    if (num_cutpoints > 0) {
+      lineEnd = cutPoint(b, c, z);
+      num_cutpoints = 2;
+    } else {
+      lineStart = cutPoint(b, c, z);
+      num_cutpoints = 1;
+    }
+  }
+  if (above_c != above_a) {
+    lineEnd = cutPoint(c, a, z);
+    if (lineEnd != lineStart) num_cutpoints = 2;
+  }
+  return num_cutpoints;
+}
+
+// the result of Triangle::CutWithPlane from the vertex sides and the
+// cut points of the three edges
+static inline int cut_result(bool above_a, bool above_b, bool above_c,
+			     const Vector2d &ab, const Vector2d &bc, const Vector2d &ca,
+			     Vector2d &lineStart, Vector2d &lineEnd)
+{
+  int num_cutpoints = 0;
+  if (above_a != above_b) {
+    lineStart = ab;
+    num_cutpoints = 1;
+  }
+  if (above_b != above_c) {
+    if (num_cutpoints > 0) {
+      lineEnd = bc;
+      num_cutpoints = 2;
+    } else {
+      lineStart = bc;
+      num_cutpoints = 1;
+    }
+  }
+  if (above_c != above_a) {
+    lineEnd = ca;
+    if (lineEnd != lineStart) num_cutpoints = 2;
+  }
+  return num_cutpoints;
+}
+
+#ifdef HAVE_AVX2_KERNEL
+// A face is cut if minZ < z <= maxZ: find those 4 faces per step, then
+// gather the vertices of 4 cut faces at a time and interpolate all 3 edges
+// with the same operations as WorldMesh::cutPoint.
+__attribute__((target("avx2")))
+static void cut_faces_avx2(const WorldMesh &world, double z,
+			   const vector<uint> *faces, uint count,
+			   int *num_cutpoints, Vector2d *lineStarts, Vector2d *lineEnds)
+{
+  const __m256d Z = _mm256_set1_pd(z);
+  const double *minZ = &world.minZ[0], *maxZ = &world.maxZ[0];
+  vector<uint> cut; // positions of cut faces
+  cut.reserve(count/4 + 4);
+  uint c = 0;
+  for (; c + 4 <= count; c += 4) {
+    __m256d zmin, zmax;
+    if (faces) {
+      const __m128i f = _mm_loadu_si128((const __m128i*)&(*faces)[c]);
+      zmin = _mm256_i32gather_pd(minZ, f, 8);
+      zmax = _mm256_i32gather_pd(maxZ, f, 8);
+    } else {
+      zmin = _mm256_loadu_pd(minZ + c);
+      zmax = _mm256_loadu_pd(maxZ + c);
+    }
+    const int mask = _mm256_movemask_pd(_mm256_and_pd(_mm256_cmp_pd(zmin, Z, _CMP_LT_OQ),
+						      _mm256_cmp_pd(Z, zmax, _CMP_LE_OQ)));
+    for (uint l = 0; l < 4; l++) {
+      num_cutpoints[c+l] = 0;
+      if (mask & (1 << l)) cut.push_back(c+l);
+    }
+  }
+  for (; c < count; c++) {
+    const uint f = faces ? (*faces)[c] : c;
+    num_cutpoints[c] = 0;
+    if (minZ[f] < z && z <= maxZ[f]) cut.push_back(c);
+  }
+
+  const uint *indices = &world.indices[0];
+  const double *vx = &world.vx[0], *vy = &world.vy[0], *vz = &world.vz[0];
+  const uint ncut = cut.size();
+  uint n = 0;
+  for (; n + 4 <= ncut; n += 4) {
+    int ia[4], ib[4], ic[4];
+    for (uint l = 0; l < 4; l++) {
+      const uint f = faces ? (*faces)[cut[n+l]] : cut[n+l];
+      ia[l] = indices[3*f]; ib[l] = indices[3*f+1]; ic[l] = indices[3*f+2];
+    }
+    const __m128i a = _mm_loadu_si128((const __m128i*)ia);
+    const __m128i b = _mm_loadu_si128((const __m128i*)ib);
+    const __m128i cc = _mm_loadu_si128((const __m128i*)ic);
+    const __m256d za = _mm256_i32gather_pd(vz, a, 8);
+    const __m256d zb = _mm256_i32gather_pd(vz, b, 8);
+    const __m256d zc = _mm256_i32gather_pd(vz, cc, 8);
+    const int above_a = _mm256_movemask_pd(_mm256_cmp_pd(Z, za, _CMP_LE_OQ));
+    const int above_b = _mm256_movemask_pd(_mm256_cmp_pd(Z, zb, _CMP_LE_OQ));
+    const int above_c = _mm256_movemask_pd(_mm256_cmp_pd(Z, zc, _CMP_LE_OQ));
+    const __m256d xa = _mm256_i32gather_pd(vx, a, 8);
+    const __m256d xb = _mm256_i32gather_pd(vx, b, 8);
+    const __m256d xc = _mm256_i32gather_pd(vx, cc, 8);
+    const __m256d ya = _mm256_i32gather_pd(vy, a, 8);
+    const __m256d yb = _mm256_i32gather_pd(vy, b, 8);
+    const __m256d yc = _mm256_i32gather_pd(vy, cc, 8);
+    double x[3][4], y[3][4];
+    __m256d t = _mm256_div_pd(_mm256_sub_pd(Z, za), _mm256_sub_pd(zb, za));
+    _mm256_storeu_pd(x[0], _mm256_add_pd(xa, _mm256_mul_pd(_mm256_sub_pd(xb, xa), t)));
+    _mm256_storeu_pd(y[0], _mm256_add_pd(ya, _mm256_mul_pd(_mm256_sub_pd(yb, ya), t)));
+    t = _mm256_div_pd(_mm256_sub_pd(Z, zb), _mm256_sub_pd(zc, zb));
+    _mm256_storeu_pd(x[1], _mm256_add_pd(xb, _mm256_mul_pd(_mm256_sub_pd(xc, xb), t)));
+    _mm256_storeu_pd(y[1], _mm256_add_pd(yb, _mm256_mul_pd(_mm256_sub_pd(yc, yb), t)));
+    t = _mm256_div_pd(_mm256_sub_pd(Z, zc), _mm256_sub_pd(za, zc));
+    _mm256_storeu_pd(x[2], _mm256_add_pd(xc, _mm256_mul_pd(_mm256_sub_pd(xa, xc), t)));
+    _mm256_storeu_pd(y[2], _mm256_add_pd(yc, _mm256_mul_pd(_mm256_sub_pd(ya, yc), t)));
+    for (uint l = 0; l < 4; l++) {
+      const uint p = cut[n+l];
+      num_cutpoints[p] = cut_result((above_a >> l) & 1, (above_b >> l) & 1,
+				    (above_c >> l) & 1,
+				    Vector2d(x[0][l], y[0][l]),
+				    Vector2d(x[1][l], y[1][l]),
+				    Vector2d(x[2][l], y[2][l]),
+				    lineStarts[p], lineEnds[p]);
+    }
+  }
+  for (; n < ncut; n++) {
+    const uint p = cut[n];
+    num_cutpoints[p] = world.cutWithPlane(faces ? (*faces)[p] : p, z,
+					  lineStarts[p], lineEnds[p]);
+  }
+}
+#endif
+
+bool WorldMesh::haveVectorKernel()
+{
+#ifdef HAVE_AVX2_KERNEL
+  static const bool avx2 = __builtin_cpu_supports("avx2");
+  return avx2;
+#else
+  return false;
+#endif
+}
+
+void WorldMesh::cutWithPlane(double z, const vector<uint> *faces, uint count,
+			     vector<int> &num_cutpoints,
+			     vector<Vector2d> &lineStarts, vector<Vector2d> &lineEnds,
+			     bool vectorised) const
+{
+  num_cutpoints.resize(count);
+  lineStarts.resize(count);
+  lineEnds.resize(count);
+  if (count == 0) return;
+#ifdef HAVE_AVX2_KERNEL
+  if (vectorised && haveVectorKernel()) {
+    cut_faces_avx2(*this, z, faces, count,
+		   &num_cutpoints[0], &lineStarts[0], &lineEnds[0]);
+    return;
+  }
+#endif
+  for (uint c = 0; c < count; c++)
+    num_cutpoints[c] = cutWithPlane(faces ? (*faces)[c] : c, z,
+				    lineStarts[c], lineEnds[c]);
+}
+
+void MeshTopology::clear()
+{
+  valid = manifold = false;
+  face_edges.clear();
+  edge_vertices.clear();
+  edge_faces.clear();
+  edge_nfaces.clear();
+}
+
+void MeshTopology::build(const Mesh &mesh)
+{
+  clear();
+  const uint nfaces = mesh.size();
+  manifold = true;
+  // join face edges with the same vertices
+  vector< pair< pair<uint,uint>, uint > > halfedges(3*nfaces);
+  for (uint h = 0; h < halfedges.size(); h++) {
+    const uint f = h/3, k = h%3;
+    const uint a = mesh.vertexIndex(f,k), b = mesh.vertexIndex(f,(k+1)%3);
+    if (a == b) manifold = false; // degenerate face
+    halfedges[h] = make_pair(make_pair(min(a,b), max(a,b)), h);
+  }
+  std::sort(halfedges.begin(), halfedges.end());
+  face_edges.resize(3*nfaces);
+  for (uint h = 0; h < halfedges.size(); ) {
+    uint n = 1;
+    while (h+n < halfedges.size() && halfedges[h+n].first == halfedges[h].first)
+      n++;
+    const uint e = edge_vertices.size()/2;
+    edge_vertices.push_back(halfedges[h].first.first);
+    edge_vertices.push_back(halfedges[h].first.second);
+    edge_faces.push_back(halfedges[h].second/3);
+    edge_faces.push_back(halfedges[h+n-1].second/3);
+    edge_nfaces.push_back(n);
+    for (uint j = h; j < h+n; j++)
+      face_edges[halfedges[j].second] = e;
+    if (n != 2)
+      manifold = false;
+    else {
+      // the two faces must traverse the edge in opposite directions
+      const uint h0 = halfedges[h].second, h1 = halfedges[h+1].second;
+      if (mesh.vertexIndex(h0/3, h0%3) == mesh.vertexIndex(h1/3, h1%3))
+	manifold = false;
+    }
+    h += n;
+  }
+  valid = true;
+}
+
+bool MeshTopology::ascending(const Mesh &mesh, uint f, uint e) const
+{
+  for (uint k = 0; k < 3; k++)
+    if (face_edges[3*f+k] == e)
+      return mesh.vertexIndex(f,k) == edge_vertices[2*e];
+  return false;
+}
+
+// breadth first through the edges with two faces
+uint MeshTopology::orientFaces(Mesh &mesh, uint &components, uint &conflicts) const
+{
+  const uint nfaces = mesh.size();
+  components = conflicts = 0;
+  vector<bool> visited(nfaces, false), flip(nfaces, false);
+  vector<uint> part; // faces of the current component
+  uint flipped = 0;
+  for (uint seed = 0; seed < nfaces; seed++) {
+    if (visited[seed]) continue;
+    components++;
+    part.clear();
+    part.push_back(seed);
+    visited[seed] = true;
+    uint nflip = 0;
+    for (uint q = 0; q < part.size(); q++) {
+      const uint f = part[q];
+      for (uint k = 0; k < 3; k++) {
+	const uint e = face_edges[3*f+k];
+	if (edge_nfaces[e] != 2) continue;
+	const uint g = (edge_faces[2*e] == f) ? edge_faces[2*e+1] : edge_faces[2*e];
+	if (g == f) continue;
+	// g has to traverse e in the other direction
+	const bool f_asc = (mesh.vertexIndex(f,k) == edge_vertices[2*e]) != flip[f];
+	const bool g_flip = (ascending(mesh, g, e) == f_asc);
+	if (!visited[g]) {
+	  visited[g] = true;
+	  flip[g] = g_flip;
+	  if (g_flip) nflip++;
+	  part.push_back(g);
+	} else if (flip[g] != g_flip && f < g)
+	  conflicts++;
+      }
+    }
+    // keep the winding of the majority
+    const bool invert = (2*nflip > part.size());
+    for (uint i = 0; i < part.size(); i++)
+      if (flip[part[i]] != invert) {
+	mesh.invertFace(part[i]);
+	flipped++;
+      }
+  }
+  return flipped;
+}
+
+// a hole runs against the winding of the faces at its edges
+void MeshTopology::boundaryLoops(const Mesh &mesh, vector< vector<uint> > &loops) const
+{
+  loops.clear();
+  // boundary edges as (from, to) in hole direction
+  vector< pair<uint,uint> > edges;
+  const uint nedges = edge_nfaces.size();
+  for (uint e = 0; e < nedges; e++) {
+    if (edge_nfaces[e] != 1) continue;
+    const uint f = edge_faces[2*e];
+    const uint lo = edge_vertices[2*e], hi = edge_vertices[2*e+1];
+    if (ascending(mesh, f, e))
+      edges.push_back(make_pair(hi, lo));
+    else
+      edges.push_back(make_pair(lo, hi));
+  }
+  std::sort(edges.begin(), edges.end());
+  vector<bool> used(edges.size(), false);
+  for (uint s = 0; s < edges.size(); s++) {
+    if (used[s]) continue;
+    vector<uint> loop;
+    uint e = s;
+    while (true) {
+      used[e] = true;
+      loop.push_back(edges[e].first);
+      const uint next = edges[e].second;
+      if (next == edges[s].first) break;
+      // first unused edge leaving next
+      vector< pair<uint,uint> >::const_iterator it =
+	std::lower_bound(edges.begin(), edges.end(), make_pair(next, 0u));
+      while (it != edges.end() && it->first == next && used[it - edges.begin()])
+	++it;
+      if (it == edges.end() || it->first != next) { loop.clear(); break; }
+      e = it - edges.begin();
+    }
+    if (loop.size() >= 3)
+      loops.push_back(loop);
+  }
+}
+
+bool MeshTopology::getContours(const WorldMesh &world, double z,
+			       const vector<uint> &faces,
+			       vector<uint> &cutfaces,
+			       vector< vector<Vector2d> > &contours) const
+{
+  if (!isManifold()) return false;
+  // find the cut faces and the edges where the cut enters and leaves them;
+  // vertices count as above like in Triangle::CutWithPlane
+  vector<uint> in_edges, out_edges;
+  for (uint c = 0; c < faces.size(); c++) {
+    const uint f = faces[c];
+    bool above[3];
+    for (uint k = 0; k < 3; k++)
+      above[k] = (z <= world.vz[world.vertexIndex(f,k)]);
+    if (above[0] == above[1] && above[1] == above[2])
+      continue;
+    cutfaces.push_back(f);
+    for (uint k = 0; k < 3; k++) {
+      if (above[k] == above[(k+1)%3]) continue;
+      // going upwards in winding order the outside is on the left
+      if (above[(k+1)%3])
+	in_edges.push_back(face_edges[3*f+k]);
+      else
+	out_edges.push_back(face_edges[3*f+k]);
+    }
+  }
+  // walk through the neighbours across the out edges
+  vector<bool> done(cutfaces.size(), false);
+  for (uint s = 0; s < cutfaces.size(); s++) {
+    if (done[s]) continue;
+    vector<Vector2d> contour;
+    uint c = s;
+    while (true) {
+      done[c] = true;
+      // always from the lower vertex index, so both faces get the same point
+      const Vector2d p = world.cutPoint(edge_vertices[2*in_edges[c]],
+					edge_vertices[2*in_edges[c]+1], z);
+      if (contour.size() == 0 || !(contour.back() == p)) // at a vertex
+	contour.push_back(p);
+      const uint e = out_edges[c];
+      const uint f = cutfaces[c];
+      const uint next = (edge_faces[2*e] == f) ? edge_faces[2*e+1] : edge_faces[2*e];
+      const vector<uint>::const_iterator it =
+	lower_bound(cutfaces.begin(), cutfaces.end(), next);
+      if (it == cutfaces.end() || *it != next)
+	return false;
+      c = it - cutfaces.begin();
+      if (c == s) break;
+      if (done[c]) return false;
+    }
+    if (contour.size() > 1 && contour.front() == contour.back())
+      contour.pop_back();
+    if (contour.size() > 2) // no single points or lines
+      contours.push_back(contour);
+  }
+  return true;
+}
+
+
 string Shape::info() const
 {
   ostringstream ostr;
-  ostr <<"Shape with "<<triangles.size() << " triangles "
+  ostr <<"Shape with "<<mesh().size() << " triangles "
        << "min/max/center: "<<Min<<Max <<Center ;
   return ostr.str();
 }
@@ -22,6 +22,7 @@
 
 #include <vector>
 #include <list>
+#include <map>
 #include <iostream>
 #include <fstream>
 #include <string>
@@ -32,6 +33,7 @@
 #include "transform3d.h"
 //#include "settings.h"
 #include "triangle.h"
+#include "mesh.h"
 #include "slicer/geometry.h"
 #include "poly.h"
 
@@ -54,12 +56,232 @@ struct Segment {
 #define sqr(x) ((x)*(x))
 
 
+// Hash grid of indexed 2D points for finding coincident or nearest points
+// without comparing against all others. Cells are cellsize wide, so all
+// points closer than cellsize to a given point are in its 3x3 neighbourhood.
+class PointHash2D
+{
+public:
+  PointHash2D(double cellsize, uint expected_size = 0);
+
+  void insert(uint index, const Vector2d &p);
+  void remove(uint index, const Vector2d &p);
+  void clear();
+  uint size() const { return count; };
+
+  // lowest index of the points with squared distance < sqdistance to p,
+  // sqdistance must not exceed cellsize^2; -1 if there is none
+  int findPoint(const Vector2d &p, double sqdistance) const;
+
+  // index of the nearest point to p for which accept(index) is true,
+  // the lowest index of equally near ones; -1 if there is none
+  template <class Accept>
+  int findNearest(const Vector2d &p, const Accept &accept, double &sqdistance) const;
+
+private:
+  struct Entry {
+    Vector2d p;
+    uint index;
+    int next;     // next entry in the same bucket
+  };
+  double cellsize;
+  uint count;
+  vector<Entry> entries;
+  vector<int> buckets;  // first entry of each bucket, size is a power of 2
+  vector<int> unused;   // removed entries
+  // number of points in each occupied column and row of cells, their
+  // first and last keys are the range the nearest search has to cover
+  std::map<int,uint> columns, rows;
+
+  int cell(double c) const { return (int)floor(c / cellsize); };
+  uint bucket(int cx, int cy) const
+  { return ((uint)cx * 73856093u ^ (uint)cy * 19349663u) & (buckets.size() - 1); };
+  void rehash(uint nbuckets);
+};
+
+template <class Accept>
+int PointHash2D::findNearest(const Vector2d &p, const Accept &accept,
+			     double &sqdistance) const
+{
+  int found = -1;
+  sqdistance = (std::numeric_limits<double>::max)();
+  if (count == 0) return found;
+  const int cx = cell(p.x()), cy = cell(p.y());
+  // the largest ring still touching an occupied cell
+  const int maxring = max(max(cx - columns.begin()->first,
+			      columns.rbegin()->first - cx),
+			  max(cy - rows.begin()->first,
+			      rows.rbegin()->first - cy));
+  for (int r = 0; r <= maxring; r++) {
+    for (int x = cx - r; x <= cx + r; x++) {
+      // only the border of the ring
+      const int ystep = (x == cx - r || x == cx + r) ? 1 : 2*r;
+      for (int y = cy - r; y <= cy + r; y += ystep) {
+	// colliding buckets only bring in extra candidates
+	for (int e = buckets[bucket(x, y)]; e >= 0; e = entries[e].next) {
+	  const Entry &en = entries[e];
+	  if (!accept(en.index)) continue;
+	  const double d = (en.p - p).squared_length();
+	  if (d < sqdistance || (d == sqdistance && (int)en.index < found)) {
+	    sqdistance = d;
+	    found = en.index;
+	  }
+	}
+      }
+    }
+    // points outside of ring r are at least r cells away
+    if (found >= 0 && sqdistance < sqr(r * cellsize))
+      break;
+  }
+  return found;
+}
+
+
+// World space copy of a shape's mesh for one transformation, built once
+// per slicing run: transformed vertices in separate coordinate arrays and
+// the z range, slope and gradient of each face, so that cutting a layer
+// only compares and interpolates.
+class WorldMesh
+{
+public:
+  WorldMesh() : valid(false) {};
+
+  void build(const Mesh &mesh, const Matrix4d &T);
+  void clear();
+  bool isValidFor(const Matrix4d &T) const { return valid && T == transform; };
+  uint size() const { return minZ.size(); };
+
+  // the same as the Triangle methods with the transformation
+  int cutWithPlane(uint face, double z, Vector2d &lineStart, Vector2d &lineEnd) const;
+  // cutWithPlane for count faces at once, the given ones or the first
+  // count, vectorised with AVX2 if the CPU has it and not disabled
+  void cutWithPlane(double z, const vector<uint> *faces, uint count,
+		    vector<int> &num_cutpoints,
+		    vector<Vector2d> &lineStarts, vector<Vector2d> &lineEnds,
+		    bool vectorised = true) const;
+  static bool haveVectorKernel();
+  bool isInZrange(uint face, double zmin, double zmax) const
+  { return minZ[face] >= zmin && maxZ[face] <= zmax; };
+  double slopeAngle(uint face) const { return slope[face]; };
+  double gradient(uint face) const { return grad[face]; };
+  Triangle transformed(uint face) const;
+
+  uint vertexIndex(uint face, uint k) const { return indices[3*face+k]; };
+  // point at z on the line from vertex a to b
+  Vector2d cutPoint(uint a, uint b, double z) const;
+
+  vector<double> vx, vy, vz;     // transformed vertices
+  vector<uint> indices;          // 3 per face
+  vector<double> minZ, maxZ;     // z range of each face
+  vector<double> slope;          // slope angle of each face
+  vector<double> grad;           // absolute z of each untransformed normal
+
+private:
+  bool valid;
+  Matrix4d transform;
+};
+
+
+// Index of the z-intervals of a shape's triangles for one transformation,
+// so that slicing only has to look at the triangles near the cutting plane.
+// Each triangle is stored once, in a level of slabs at least as high as
+// the triangle itself, so a query only visits a few slabs per level.
+class TriangleZIndex
+{
+public:
+  TriangleZIndex() : valid(false) {};
+
+  void build(const WorldMesh &world, const Matrix4d &T);
+  void clear();
+  bool isValidFor(const Matrix4d &T) const { return valid && T == transform; };
+
+  // ascending indices of all triangles overlapping zmin..zmax
+  void getTriangles(double zmin, double zmax, vector<uint> &indices) const;
+
+private:
+  friend class TriangleSweep;
+  bool valid;
+  Matrix4d transform;
+  vector<double> minZ, maxZ;     // z extents of each transformed triangle
+  vector<uint> byMinZ;           // triangle indices sorted by minZ
+  double base_z, base_height;    // start and slab height of level 0
+  vector<uint> level_start;      // first slab of each level in slab_start
+  vector<uint> slab_start;       // first entry of each slab in entries
+  vector<uint> entries;          // triangle indices, ordered by slab
+};
+
+
+// Sweeps a z window upwards through an index, keeping the set of
+// triangles overlapping the window: triangles enter the set in the
+// order of their minimum z and leave it when the window has passed them.
+class TriangleSweep
+{
+public:
+  TriangleSweep(const TriangleZIndex &index);
+
+  // move the window up to zmin..zmax, returns the ascending indices
+  // of all triangles overlapping it
+  const vector<uint> &advance(double zmin, double zmax);
+
+private:
+  const TriangleZIndex *index;
+  bool started;
+  uint next;                     // next entry of index->byMinZ to enter
+  vector<uint> active;
+};
+
+
+// Edge connectivity of a shape's mesh. Each crossed edge gives one cut
+// point and the face across an edge continues a contour, so cut contours
+// are chained by topology instead of matching segment end points by
+// their coordinates.
+class MeshTopology
+{
+public:
+  MeshTopology() : valid(false), manifold(false) {};
+
+  void build(const Mesh &mesh);
+  void clear();
+  bool isValid() const { return valid; };
+  // every edge has two faces traversing it in opposite directions
+  bool isManifold() const { return valid && manifold; };
+
+  // Contours of the faces (ascending indices) of the world mesh cut at z,
+  // oriented like the cut segments of Shape::getCutlines. Also returns
+  // the cut faces, ascending. False if the cut does not close up.
+  bool getContours(const WorldMesh &world, double z, const vector<uint> &faces,
+		   vector<uint> &cutfaces,
+		   vector< vector<Vector2d> > &contours) const;
+
+  // Flip faces of the mesh so that faces sharing an edge traverse it in
+  // opposite directions, the majority of each connected part keeps its
+  // winding. Returns the number of flipped faces, the topology has to
+  // be built again after flipping.
+  uint orientFaces(Mesh &mesh, uint &components, uint &conflicts) const;
+  // loops of edges with only one face, as vertices in hole order
+  void boundaryLoops(const Mesh &mesh, vector< vector<uint> > &loops) const;
+
+private:
+  bool valid, manifold;
+  vector<uint> face_edges;       // 3 per face, edge k from corner k to k+1
+  vector<uint> edge_vertices;    // 2 per edge, ascending
+  vector<uint> edge_faces;       // 2 per edge
+  vector<uint> edge_nfaces;      // number of faces at each edge
+
+  // edge e traversed from its lower to its higher vertex by face f
+  bool ascending(const Mesh &mesh, uint f, uint e) const;
+};
+
+
 class Shape
 {
 public:
   virtual short dimensions(){return 3;};
 
 	Shape();
+	// copies share the mesh until one of them changes its geometry
+	Shape(const Shape &other);
+	Shape &operator=(const Shape &other);
 	/* Shape(string filename, istream &text); */
 	virtual ~Shape(){};
 	Glib::ustring filename;
@@ -81,14 +303,27 @@ public:
 				    double &max_gradient,
 				    vector<Poly> &supportpolys,
 				    double max_supportangle,
-				    double thickness = -1) const;
+				    double thickness = -1,
+				    const vector<uint> *triangle_indices = NULL) const;
 	// Extract a 2D polygonset from a 3D model:
 	// void CalcLayer(const Matrix4d &T, CuttingPlane *plane) const;
 
     virtual vector<Vector3d> getMostUsedNormals() const;
-	// Auto-Rotate object to have the largest area surface down for printing:
-    virtual void OptimizeRotation();
+	// Auto-Rotate object to have the largest area surface down for printing,
+	// with supportangle >= 0 also avoid overhangs needing support:
+    virtual void OptimizeRotation(double supportangle = -1);
     virtual void CalcBBox();
+	// Build the z index, world space mesh for slicing with
+	// transformation T and the mesh topology, if not done yet:
+	void prepareSlicing(const Matrix4d &T=Matrix4d::IDENTITY);
+	// Drop the world space mesh after slicing:
+	void finishSlicing();
+	// Compare and time the cut kernels on all faces, slicing prepared:
+	void benchmarkCutting(const Matrix4d &T, double thickness, ostream &out) const;
+	const TriangleZIndex &getZIndex() const {return zindex;};
+	bool sameGeometry(const Shape &other) const
+	{ return geometry == other.geometry || mesh().sameGeometry(other.mesh()); };
+	bool sharesGeometry() const { return geometry->isShared(); };
 	// Rotation for manual rotate and used by OptimizeRotation:
     virtual void Rotate(const Vector3d & axis, const double &angle);
 	void Twist(double angle);
@@ -125,7 +360,9 @@ public:
     double volume() const;
 
     void invertNormals();
-    void repairNormals(double sqdistance);
+    // Weld vertices closer than weld_distance, make the winding consistent
+    // in every connected part and report holes, closing them if asked:
+    void repairMesh(double weld_distance, bool close_holes);
     virtual void mirror();
     void makeHollow(double wallthickness);
     virtual void splitshapes(vector<Shape*> &shapes, ViewProgress *progress=NULL);
@@ -142,28 +379,46 @@ public:
     void addTriangles(const vector<Triangle> &tr);
 
     void setTriangles(const vector<Triangle> &triangles_);
+    // takes over the faces of mesh_, leaving it empty
+    void setMesh(Mesh &mesh_);
 
-    uint size() const {return triangles.size();}
-
-protected:
-
-    int gl_List;
+    uint size() const {return mesh().size();}
 
 private:
 
-    vector<Triangle> triangles;
+    Glib::RefPtr<SharedMesh> geometry;
+    const Mesh &mesh() const { return geometry->mesh; };
+    // the mesh for changing it, a copy of its own if shared
+    Mesh &editMesh();
+    TriangleZIndex zindex;
+    WorldMesh world;
+    MeshTopology topology;
     //vector<Polygon2d>  polygons;  // surface polygons instead of triangles
     void calcPolygons();
 
+    // triangles to cut at z: the given ones, those found in the z index
+    // (in storage) or NULL for all
+    const vector<uint> *nearTriangles(const Matrix4d &transform, double z,
+				      double supportangle, double thickness,
+				      const vector<uint> *triangle_indices,
+				      vector<uint> &storage) const;
+
+    // contours at z through the mesh topology, false if not possible
+    bool getContoursAtZ(const Matrix4d &T, double z,
+			vector<Poly> &polys, double &max_grad,
+			vector<Triangle> &support_triangles,
+			double supportangle,
+			double thickness,
+			const vector<uint> *triangle_indices) const;
+
     // returns maximum gradient
     vector<Segment> getCutlines(const Matrix4d &T, double z,
 				vector<Vector2d> &vertices, double &max_grad,
 				vector<Triangle> &support_triangles,
 				double supportangle,
-				double thickness) const;
+				double thickness,
+				const vector<uint> *triangle_indices = NULL) const;
 
-    bool hasAdjacentTriangleTo(const Triangle &triangle,
-			       double sqdistance = 0.05) const;
 };
 
 
@@ -27,6 +27,8 @@
 // limfit library for arc fitting
 #include <lmmin.h>
 
+#include <queue>
+
 
 // #ifdef WIN32
 // #  include <GL/glut.h>	// Header GLUT Library
@@ -702,135 +704,280 @@ bool pointInPolys(const Vector2d &point,  const vector<Poly> &polys)
   return false;
 }
 
-//  Public-domain code by Darel Rex Finley, 2006.
-// http://alienryderflex.com/shortest_path/
+CombingGraph::CombingGraph(const vector<Poly> &polys_, double simplify_)
+  : shells(polys_), simplify(simplify_), built(false), locator(NULL),
+    cellsize(1.), nx(0), ny(0)
+{
+}
+
+CombingGraph::~CombingGraph()
+{
+  delete locator;
+}
 
-// will return false
-// if the line cuts any of the given polygons except excluded one
-bool lineInPolys(const Vector2d &from, const Vector2d &to, const vector<Poly> &polys,
-		 uint excludepoly, double maxerr)
+void CombingGraph::build()
 {
-  uint ninter = 0;
-  for (uint i=0; i< polys.size(); i++) {
-    if (i != excludepoly){
-      if (polys[i].vertexInside(from)) ninter++;
-      if (polys[i].vertexInside(to)) ninter++;
-      vector<Intersection> inter = polys[i].lineIntersections(from,to,maxerr);
-      ninter += inter.size();
+  built = true;
+  polys = shells;
+  for (uint p = 0; p < polys.size(); p++)
+    if (simplify > 0 && polys[p].size() > 3) {
+      polys[p].cleanup(simplify);
+      if (polys[p].size() < 3) polys[p] = shells[p];
     }
+  const uint npolys = polys.size();
+  locator = new PolyLocator(polys);
+
+  // nesting of the polys: even depth is an outline, odd a hole
+  vector<uint> around;
+  depth.assign(npolys, 0);
+  for (uint p = 0; p < npolys; p++) {
+    if (polys[p].size() < 3) continue;
+    locator->polysAt(polys[p].vertices[0], around);
+    depth[p] = around.size() - std::count(around.begin(), around.end(), p);
+  }
+  island.resize(npolys);
+  for (uint p = 0; p < npolys; p++) {
+    island[p] = p;
+    if (depth[p] % 2 == 0 || polys[p].size() < 3) continue;
+    locator->polysAt(polys[p].vertices[0], around);
+    for (uint a = 0; a < around.size(); a++)
+      if (around[a] != p && depth[around[a]] + 1 == depth[p])
+	island[p] = around[a];
   }
-  return (ninter != 0);
-}
 
-//  Finds the shortest path from from to to that stays within the polygon set.
-//
-//  Note:  To be safe, the solutionX and solutionY arrays should be large enough
-//         to accommodate all the corners of your polygon set (although it is
-//         unlikely that anywhere near that many elements will ever be needed).
-//
-//  Returns true if the optimal solution was found, or false if there is no solution.
-//  If a solution was found, the solution vector will contain the coordinates
-//  of the intermediate nodes of the path, in order.  (The startpoint and endpoint
-//  are assumed, and will not be included in the solution.)
+  islandnodes.resize(npolys);
+  uint nedges = 0;
+  Vector2d Max(-INFTY, -INFTY);
+  Min = Vector2d(INFTY, INFTY);
+  for (uint p = 0; p < npolys; p++) {
+    const vector<Vector2d> &v = polys[p].vertices;
+    const uint n = v.size();
+    if (n < 3) continue;
+    nedges += n;
+    double area = 0;
+    for (uint i = 0; i < n; i++) {
+      area += perp(v[i], v[(i+1)%n]);
+      Min.x() = min(Min.x(), v[i].x()); Max.x() = max(Max.x(), v[i].x());
+      Min.y() = min(Min.y(), v[i].y()); Max.y() = max(Max.y(), v[i].y());
+    }
+    const bool insideleft = (area > 0) == (depth[p] % 2 == 0);
+    for (uint i = 0; i < n; i++) {
+      Node node;
+      node.v = v[i];
+      node.prev = v[(i+n-1)%n];
+      node.next = v[(i+1)%n];
+      if (!insideleft) std::swap(node.prev, node.next);
+      if (perp(node.v - node.prev, node.next - node.v) >= 0) continue; // convex
+      node.island = island[p];
+      islandnodes[node.island].push_back(nodes.size());
+      nodes.push_back(node);
+    }
+  }
+  if (nedges == 0) return;
+
+  // every edge in all cells its bounding box touches
+  const double width = Max.x()-Min.x(), height = Max.y()-Min.y();
+  cellsize = (width*height > 0) ? sqrt(width*height/nedges) : max(width, height)/nedges;
+  if (!(cellsize > 0)) cellsize = 1.;
+  nx = min((int)(width/cellsize) + 1, 4096);
+  ny = min((int)(height/cellsize) + 1, 4096);
+  for (uint p = 0; p < npolys; p++) {
+    const vector<Vector2d> &v = polys[p].vertices;
+    if (v.size() < 3) continue;
+    for (uint i = 0; i < v.size(); i++) {
+      edgeends.push_back(v[i]);
+      edgeends.push_back(v[(i+1)%v.size()]);
+    }
+  }
+  cellstart.assign(nx*ny+1, 0);
+  vector<uint> fill;
+  for (uint pass = 0; pass < 2; pass++) {
+    for (uint e = 0; e < edgeends.size()/2; e++) {
+      const Vector2d &a = edgeends[2*e], &b = edgeends[2*e+1];
+      const int x0 = min((int)((min(a.x(), b.x())-Min.x())/cellsize), nx-1),
+	x1 = min((int)((max(a.x(), b.x())-Min.x())/cellsize), nx-1),
+	y0 = min((int)((min(a.y(), b.y())-Min.y())/cellsize), ny-1),
+	y1 = min((int)((max(a.y(), b.y())-Min.y())/cellsize), ny-1);
+      for (int y = y0; y <= y1; y++)
+	for (int x = x0; x <= x1; x++) {
+	  if (pass == 0) cellstart[y*nx+x+1]++;
+	  else celledges[fill[y*nx+x]++] = e;
+	}
+    }
+    if (pass == 0) {
+      for (int c = 0; c < nx*ny; c++) cellstart[c+1] += cellstart[c];
+      celledges.resize(cellstart.back());
+      fill.assign(cellstart.begin(), cellstart.end()-1);
+    }
+  }
 
-struct pathpoint {
-  Vector2d v;
-  double totalDist;
-  int prev;
-};
-// excludepoly: poly not to test, contains from and to vectors.
-bool shortestPath(const Vector2d &from, const Vector2d &to,
-		  const vector<Poly> &polys, int excludepoly,
-		  vector<Vector2d> &path, double maxerr)
+  // connect the reflex vertices of each island that see each other
+  adjacent.resize(nodes.size());
+  for (uint i = 0; i < islandnodes.size(); i++) {
+    const vector<uint> &in = islandnodes[i];
+    for (uint a = 0; a < in.size(); a++)
+      for (uint b = a+1; b < in.size(); b++) {
+	const Node &na = nodes[in[a]], &nb = nodes[in[b]];
+	if (canPass(na, nb.v) && canPass(nb, na.v) && visible(na.v, nb.v)) {
+	  adjacent[in[a]].push_back(in[b]);
+	  adjacent[in[b]].push_back(in[a]);
+	}
+      }
+  }
+}
+
+// inside by even-odd rule, with the island p is on
+bool CombingGraph::inside(const Vector2d &p, uint &isl) const
 {
-  //  Fail if either the startpoint or endpoint is outside the polygon set.
-  if (!pointInPolys(from, polys)
-      ||  !pointInPolys(to, polys))
-    return false;
+  vector<uint> around;
+  locator->polysAt(p, around);
+  if (around.size() % 2 == 0) return false;
+  uint innermost = around[0];
+  for (uint a = 1; a < around.size(); a++)
+    if (depth[around[a]] > depth[innermost]) innermost = around[a];
+  isl = island[innermost];
+  return true;
+}
 
-  //  If there is a straight-line solution, no path vertices added
-  if (lineInPolys(from, to, polys, excludepoly, maxerr))
-    return true;
-
-  const double INF = 9999999.;     //  (larger than total solution dist could ever be)
-  double  bestDist, newDist ;
-  // uint numpoints=0;
-  // for (uint i=0; i<polys.size(); i++) numpoints += polys[i].size();
-  vector<struct pathpoint> pointList;
-  //  Build a point list that refers to the corners of the
-  //  polygons, as well as to the startpoint and endpoint.
-  pointList.push_back((pathpoint){from, 0, 0});
-  for (uint i=0; i<polys.size(); i++)
-    for (uint j=0; j<polys[i].size(); j++)
-      pointList.push_back((pathpoint){polys[i].vertices[j], 0, 0});
-  pointList.push_back((pathpoint){to, 0, 0});
-  uint pointCount = pointList.size();
-
-  //  Initialize the shortest-path tree to include just the startpoint.
-  uint treeCount=1;
-
-  //  Iteratively grow the shortest-path tree until it reaches the endpoint
-  //  -- or until it becomes unable to grow, in which case exit with failure.
-  uint bestI = 0, bestJ = 0;
-  while (bestJ < pointCount-1) { // until the to-point is arrived
-    bestDist = INF;
-    // for every path point so far find another with minimal total path length
-    for (uint i = 0; i < treeCount; i++) {
-      for (uint j = treeCount; j < pointCount; j++) {
-	if (lineInPolys(pointList[i].v, pointList[j].v,
-			polys, -1, maxerr)) { // line does not intersect
-	  // take point into account
-	  newDist = pointList[i].totalDist +
-	    (pointList[i].v - pointList[j].v).length();
-	  if (newDist < bestDist) { // if shortest total path
-	    //cerr << i << " found " << j << " - " << newDist << " - " <<pointList[j].v <<endl;
-	    bestDist = newDist;
-	    bestI = i;
-	    bestJ = j;
-	  }
-	}
+// a-b crosses an edge, touching is no crossing
+// (cells along the line like Amanatides & Woo)
+bool CombingGraph::crossesEdges(const Vector2d &a, const Vector2d &b) const
+{
+  if (nx == 0) return false;
+  const double x0 = (a.x()-Min.x())/cellsize, y0 = (a.y()-Min.y())/cellsize,
+    x1 = (b.x()-Min.x())/cellsize, y1 = (b.y()-Min.y())/cellsize;
+  int cx = (int)floor(x0), cy = (int)floor(y0);
+  const int ex = (int)floor(x1), ey = (int)floor(y1);
+  const int sx = (x1 > x0) ? 1 : -1, sy = (y1 > y0) ? 1 : -1;
+  const double dx = abs(x1-x0), dy = abs(y1-y0);
+  double tx = (dx > 0) ? ((sx > 0 ? cx+1-x0 : x0-cx) / dx) : INFTY,
+    ty = (dy > 0) ? ((sy > 0 ? cy+1-y0 : y0-cy) / dy) : INFTY;
+  const double tdx = (dx > 0) ? 1/dx : INFTY, tdy = (dy > 0) ? 1/dy : INFTY;
+  const Vector2d ab = b - a;
+  for (int steps = abs(ex-cx) + abs(ey-cy); steps >= 0; steps--) {
+    if (cx >= 0 && cx < nx && cy >= 0 && cy < ny) {
+      const uint cell = cy*nx + cx;
+      for (uint k = cellstart[cell]; k < cellstart[cell+1]; k++) {
+	const Vector2d &c = edgeends[2*celledges[k]], &d = edgeends[2*celledges[k]+1];
+	const double d1 = perp(ab, c-a), d2 = perp(ab, d-a);
+	if (!((d1 > 0 && d2 < 0) || (d1 < 0 && d2 > 0))) continue;
+	const Vector2d cd = d - c;
+	const double d3 = perp(cd, a-c), d4 = perp(cd, b-c);
+	if ((d3 > 0 && d4 < 0) || (d3 < 0 && d4 > 0)) return true;
       }
     }
-    if (bestDist==INF) return false;   //  (no solution)
-
-    pointList[bestJ].prev      = bestI   ;
-    pointList[bestJ].totalDist = bestDist;
-    //cerr << bestI << " PRE "<<pointList[bestJ].prev << endl;
-    // store all tree points below treeCount
-    // struct pathpoint SWAP = pointList[treeCount];
-    // pointList[treeCount] = pointList[bestJ];
-    // pointList[bestJ] = SWAP;
-    swap(pointList[bestJ], pointList[treeCount]);
-    treeCount++;
+    if (tx < ty) { tx += tdx; cx += sx; }
+    else         { ty += tdy; cy += sy; }
   }
-  // for (uint i = 0; i < treeCount; i++) {
-  //   cerr << i << " PL " << pointList[i].prev << endl;
-  // }
-  int numsolutions = 0;
-  int i = treeCount -1;
-  while (i > 0) {
-    path.push_back(pointList[i].v);
-    i = pointList[i].prev;
-    numsolutions++;
-    cerr << treeCount << " - " << numsolutions << " - " << i << endl;
+  return false;
+}
+
+bool CombingGraph::visible(const Vector2d &a, const Vector2d &b) const
+{
+  uint isl;
+  return !crossesEdges(a, b) && inside((a+b)/2., isl);
+}
+
+// a shortest path only bends around a reflex vertex: the line to the
+// other point has both neighbours on one side and does not start outside
+bool CombingGraph::canPass(const Node &node, const Vector2d &other) const
+{
+  const Vector2d d = other - node.v;
+  const double sprev = perp(d, node.prev - node.v), snext = perp(d, node.next - node.v);
+  if ((sprev > 0 && snext < 0) || (sprev < 0 && snext > 0)) return false;
+  return !(perp(node.v - node.prev, d) < 0 && perp(node.next - node.v, d) < 0);
+}
+
+uint CombingGraph::cellOf(const Vector2d &p) const
+{
+  const int x = (int)CLAMP(floor((p.x()-Min.x())/cellsize), 0., nx-1.),
+    y = (int)CLAMP(floor((p.y()-Min.y())/cellsize), 0., ny-1.);
+  return y*nx + x;
+}
+
+bool CombingGraph::findPath(const Vector2d &from, const Vector2d &to,
+			    vector<Vector2d> &path)
+{
+  if (!built) build();
+  uint fromisland, toisland;
+  if (!inside(from, fromisland) || !inside(to, toisland)
+      || fromisland != toisland)
+    return false;
+  if (!crossesEdges(from, to)) return true;
+
+  const std::pair<uint,uint> key(cellOf(from), cellOf(to));
+  std::map< std::pair<uint,uint>, vector<uint> >::const_iterator cached =
+    routes.find(key);
+  if (cached != routes.end()) {
+    const vector<uint> &route = cached->second;
+    const Node &first = nodes[route.front()], &last = nodes[route.back()];
+    if (canPass(first, from) && canPass(last, to)
+	&& visible(from, first.v) && visible(last.v, to)) {
+      for (uint r = 0; r < route.size(); r++)
+	path.push_back(nodes[route[r]].v);
+      return true;
+    }
   }
-  return true;
 
-  int j = numsolutions-1;
-  if (j > 0) {
-    int psize = path.size();
-    path.resize(psize + j);
-    i = treeCount-1;
-    while (j >= 0) {
-      i = pointList[i].prev;
-      path[psize + j] = pointList[i].v;
-      j--;
+  // A* from the nodes seen from the start to those seen from the end
+  const vector<uint> &in = islandnodes[fromisland];
+  vector<double> dist(nodes.size(), INFTY);
+  vector<int> prev(nodes.size(), -1);
+  vector<bool> done(nodes.size(), false), seesend(nodes.size(), false);
+  typedef std::pair<double,uint> Open;
+  std::priority_queue< Open, vector<Open>, std::greater<Open> > open;
+  for (uint k = 0; k < in.size(); k++) {
+    const Node &node = nodes[in[k]];
+    if (canPass(node, to) && visible(node.v, to))
+      seesend[in[k]] = true;
+    if (canPass(node, from) && visible(from, node.v)) {
+      dist[in[k]] = (node.v - from).length();
+      open.push(Open(dist[in[k]] + (to - node.v).length(), in[k]));
     }
   }
-  //  Success.
+  double best = INFTY;
+  int last = -1;
+  while (!open.empty()) {
+    const Open o = open.top();
+    open.pop();
+    if (o.first >= best) break;
+    const uint u = o.second;
+    if (done[u]) continue;
+    done[u] = true;
+    if (seesend[u] && dist[u] + (to - nodes[u].v).length() < best) {
+      best = dist[u] + (to - nodes[u].v).length();
+      last = u;
+    }
+    for (uint k = 0; k < adjacent[u].size(); k++) {
+      const uint w = adjacent[u][k];
+      const double d = dist[u] + (nodes[w].v - nodes[u].v).length();
+      if (d < dist[w]) {
+	dist[w] = d;
+	prev[w] = u;
+	open.push(Open(d + (to - nodes[w].v).length(), w));
+      }
+    }
+  }
+  if (last < 0) return false;
+  vector<uint> route;
+  for (int n = last; n >= 0; n = prev[n])
+    route.push_back(n);
+  std::reverse(route.begin(), route.end());
+  for (uint r = 0; r < route.size(); r++)
+    path.push_back(nodes[route[r]].v);
+  routes[key] = route;
   return true;
 }
 
+// excludepoly and maxerr are not used any more
+bool shortestPath(const Vector2d &from, const Vector2d &to,
+		  const vector<Poly> &polys, int excludepoly,
+		  vector<Vector2d> &path, double maxerr)
+{
+  CombingGraph graph(polys);
+  return graph.findPath(from, to, path);
+}
+
 
 
 /////////////////////////// CONVEX HULL /////////////////////////
@@ -22,6 +22,8 @@
 #include "stdafx.h"
 #include "arcball.h"
 
+#include <map>
+
 
 #define PI 3.141592653589793238462643383279502884197169399375105820974944592308
 
@@ -104,6 +106,59 @@ Vector3d random_displaced(const Vector3d &v, double delta=0.05);
 Vector2d random_displaced(const Vector2d &v, double delta=0.05);
 
 
+// Shortest paths inside a set of polys (even-odd), for travel moves.
+// The graph of mutually visible reflex vertices of the simplified polys
+// is built on the first query and searched by A* for every move. The
+// route last found between the same two grid cells is tried first.
+class CombingGraph
+{
+public:
+  CombingGraph(const vector<Poly> &polys, double simplify = 0);
+  ~CombingGraph();
+
+  // the points between from and to, none for a straight move,
+  // false if from and to are not connected inside
+  bool findPath(const Vector2d &from, const Vector2d &to,
+		vector<Vector2d> &path);
+
+private:
+  const vector<Poly> &shells;
+  const double simplify;
+  bool built;
+  vector<Poly> polys; // simplified shells
+  PolyLocator *locator;
+  vector<uint> depth;  // number of polys around each poly
+  vector<uint> island; // outer poly of each poly
+
+  // reflex vertex, with the inside left of prev-v-next
+  struct Node {
+    Vector2d v, prev, next;
+    uint island;
+  };
+  vector<Node> nodes;
+  vector< vector<uint> > islandnodes;
+  vector< vector<uint> > adjacent;
+
+  // grid of the poly edges for crossing tests
+  Vector2d Min;
+  double cellsize;
+  int nx, ny;
+  vector<uint> cellstart, celledges;
+  vector<Vector2d> edgeends; // 2 per edge
+
+  std::map< std::pair<uint,uint>, vector<uint> > routes;
+
+  void build();
+  bool inside(const Vector2d &p, uint &isl) const;
+  bool crossesEdges(const Vector2d &a, const Vector2d &b) const;
+  bool visible(const Vector2d &a, const Vector2d &b) const;
+  bool canPass(const Node &node, const Vector2d &other) const;
+  uint cellOf(const Vector2d &p) const;
+
+  CombingGraph(const CombingGraph &);
+  CombingGraph &operator=(const CombingGraph &);
+};
+
 bool shortestPath(const Vector2d &from, const Vector2d &to,
 		  const vector<Poly> &polys, int excludepoly,
 		  vector<Vector2d> &path, double maxerr);
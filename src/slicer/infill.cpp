@@ -22,10 +22,7 @@
 #include "layer.h"
 
 
-vector<struct Infill::pattern> Infill::savedPatterns;
-#ifdef _OPENMP
-omp_lock_t Infill::save_lock;
-#endif
+Infill::pattern *Infill::savedPatterns = NULL;
 
 void hilbert(int level,int direction, double infillDistance, vector<Vector2d> &v);
 
@@ -58,19 +55,69 @@ void Infill::clear()
   m_tofillpolys.clear();
 }
 
+// only while no infill is made
 void Infill::clearPatterns() {
-  for (uint i=0; i<savedPatterns.size(); i++) {
-    savedPatterns[i].type = INVALIDINFILL;
-    savedPatterns[i].cpolys.clear();
+  pattern *p = savedPatterns;
+  savedPatterns = NULL;
+  while (p) {
+    pattern *next = p->next;
+    delete p;
+    p = next;
   }
-  savedPatterns.clear();
-  //cerr << "clearpatterns " << savedPatterns.size() << endl;
-#ifdef _OPENMP
-  omp_destroy_lock(&save_lock);
-  omp_init_lock(&save_lock);
-#endif
 }
 
+bool Infill::pattern::matches(InfillType type, double distance, double angle) const
+{
+  return this->type == type &&
+    abs(this->distance-distance) < 0.01*distance &&
+    (this->angle == angle || abs(this->angle-angle) < 0.01*abs(angle));
+}
+
+bool Infill::pattern::covers(const Vector2d &Min, const Vector2d &Max) const
+{
+  return this->Min.x() <= Min.x() && this->Min.y() <= Min.y() &&
+    this->Max.x() >= Max.x() && this->Max.y() >= Max.y();
+}
+
+// Find the saved pattern covering Min-Max or add a new one (isnew) that
+// the caller has to make. Too small patterns stay for the threads using
+// them, the new one covers them too and is found first.
+Infill::pattern *Infill::getPattern(InfillType type, double distance, double angle,
+				    const Vector2d &Min, const Vector2d &Max,
+				    bool &isnew)
+{
+  pattern *newPattern = new pattern;
+  newPattern->type = type;
+  newPattern->angle = angle;
+  newPattern->distance = distance;
+  newPattern->Min = Min;
+  newPattern->Max = Max;
+  newPattern->ready = 0;
+  pattern *checked = NULL; // this and older ones have been looked at
+  while (true) {
+    pattern *head = (pattern*) g_atomic_pointer_get(&savedPatterns);
+    for (pattern *p = head; p != checked; p = p->next) {
+      if (!p->matches(type, distance, angle)) continue;
+      if (p->covers(Min, Max)) {
+	delete newPattern;
+	while (!g_atomic_int_get(&p->ready)) // another thread makes it
+	  g_thread_yield();
+	isnew = false;
+	return p;
+      }
+      newPattern->Min = Vector2d(min(newPattern->Min.x(), p->Min.x()),
+				 min(newPattern->Min.y(), p->Min.y()));
+      newPattern->Max = Vector2d(max(newPattern->Max.x(), p->Max.x()),
+				 max(newPattern->Max.y(), p->Max.y()));
+    }
+    newPattern->next = head;
+    if (g_atomic_pointer_compare_and_exchange(&savedPatterns, head, newPattern)) {
+      isnew = true;
+      return newPattern;
+    }
+    checked = head;
+  }
+}
 
 
 // fill polys with type etc.
@@ -85,14 +132,23 @@ void Infill::addPolys(double z, const vector<Poly> &polys, InfillType type,
 {
   this->infillDistance = infillDistance;
 
-#ifdef _OPENMP
-  omp_set_lock(&save_lock);
-#endif
-  ClipperLib::Paths patterncpolys =
-    makeInfillPattern(type, polys, infillDistance, offsetDistance, rotation);
-#ifdef _OPENMP
-  omp_unset_lock(&save_lock);
-#endif
+  switch (type) {
+  case ParallelInfill:
+  case SupportInfill:
+  case RaftInfill:
+  case BridgeInfill: // no pattern, the lines are made directly
+    m_tofillpolys = polys;
+    m_type = type;
+    m_angle = rotation;
+    cached = false;
+    infillpolys = scanlineFill(z, polys, infillDistance);
+    return;
+  default: break;
+  }
+  ClipperLib::Paths uncached;
+  const ClipperLib::Paths &patterncpolys =
+    makeInfillPattern(type, polys, infillDistance, offsetDistance, rotation,
+		      uncached);
   addPolys(z, polys, patterncpolys, offsetDistance);
 }
 
@@ -151,22 +207,21 @@ void Infill::addPolys(double z, const vector<Poly> &polys,
 }
 
 // generate infill pattern as a vector of polygons
-ClipperLib::Paths Infill::makeInfillPattern(InfillType type,
-					       const vector<Poly> &tofillpolys,
-					       double infillDistance,
-					       double offsetDistance,
-					       double rotation)
+const ClipperLib::Paths &Infill::makeInfillPattern(InfillType type,
+						   const vector<Poly> &tofillpolys,
+						   double infillDistance,
+						   double offsetDistance,
+						   double rotation,
+						   ClipperLib::Paths &cpolys)
 {
-  ClipperLib::Paths cpolys;
+  cpolys.clear();
   m_tofillpolys = tofillpolys;
   m_type = type;
 
   if (tofillpolys.size()==0) return cpolys;
   cached = false;
-  //cerr << "have " << savedPatterns.size()<<" saved patterns " << endl;
-  // look for saved pattern for this rotation
-  const Vector2d Min = layer->getMin();
-  const Vector2d Max = layer->getMax();
+  Vector2d Min = layer->getMin();
+  Vector2d Max = layer->getMax();
   while (rotation > 2*M_PI) rotation -= 2*M_PI;
   while (rotation < 0) rotation += 2*M_PI;
   m_angle = rotation;
@@ -177,41 +232,22 @@ ClipperLib::Paths Infill::makeInfillPattern(InfillType type,
     else
       m_angle = 0.;
   }
-  //omp_set_lock(&save_lock);
-  //int tid = omp_get_thread_num( );
-  //cerr << "thread "<<tid << " looking for pattern " << endl;
-  if (type != PolyInfill) { // can't save PolyInfill
-    if (savedPatterns.size()>0){
-      vector<uint> too_small;
-      for (vector<struct pattern>::iterator sIt=savedPatterns.begin();
-      	   sIt != savedPatterns.end(); sIt++){
-	if (sIt->type == type &&
-	    abs((sIt->distance-infillDistance)/infillDistance) < 0.01 &&
-	    abs((sIt->angle-m_angle)/m_angle) < 0.01 )
-	  {
-	    //cerr << name << " found saved pattern no " << sIt-savedPatterns.begin() << " with " << sIt->cpolys.size() <<" polys"<< endl << "type "<< sIt->type << sIt->Min << sIt->Max << endl;
-	    // is it too small for this layer?
-	    if (sIt->Min.x() > Min.x() || sIt->Min.y() > Min.y() ||
-		sIt->Max.x() < Max.x() || sIt->Max.y() < Max.y())
-	      {
-		too_small.push_back(sIt-savedPatterns.begin());
-		//break; // there is no other match
-	      }
-	    else {
-	      cached = true;
-	      return sIt->cpolys;
-	    }
-	  }
-      }
-      sort(too_small.rbegin(), too_small.rend());
-      for (uint i = 0; i < too_small.size(); i++) {
-	savedPatterns.erase(savedPatterns.begin()+too_small[i]);
-      }
+  // look for saved pattern for this rotation
+  pattern *saved = NULL;
+  if (type != PolyInfill &&
+      type != ZigzagInfill &&
+      type != ThinInfill ) { // can't save these
+    bool isnew;
+    saved = getPattern(type, infillDistance, m_angle, Min, Max, isnew);
+    if (!isnew) {
+      cached = true;
+      return saved->cpolys;
     }
+    // make it for the layers it has to cover
+    Min = saved->Min;
+    Max = saved->Max;
   }
-  //omp_unset_lock(&save_lock);
   // none found - make new:
-  bool zigzag = false;
   switch (type)
     {
     case HexInfill:
@@ -272,59 +308,33 @@ ClipperLib::Paths Infill::makeInfillPattern(InfillType type,
       }
       break;
     case SmallZigzagInfill: // small zigzag lines -> square pattern
-      zigzag = true;
-    //case ZigzagInfill: // long zigzag lines
-    case SupportInfill:
-    case RaftInfill:
-    case BridgeInfill:
-    case ParallelInfill:
       {
 	Vector2d center = (Min+Max)/2.;
 	// make square that masks everything even when rotated
 	Vector2d diag = Max-Min;
 	double square = max(diag.x(),diag.y());
 	Vector2d sqdiag(square*2/3,square*2/3);
-	Vector2d pMin=center-sqdiag, pMax=center+sqdiag;
-	if (zigzag) pMin=Vector2d::ZERO; // fixed position
-	// cerr << pMin << "--"<<pMax<< "::"<< center << endl;
+	Vector2d pMin=Vector2d::ZERO, pMax=center+sqdiag; // fixed position
 	Poly poly(this->layer->getZ());
-	uint count = 0;
 	for (double x = pMin.x(); x < pMax.x(); ) {
 	  double x2 = x+infillDistance;
 	  poly.addVertex(x, pMin.y());
-	  if (zigzag) { // zigzag -> squares
-	    double ymax=pMax.y();;
-	    for (double y = pMin.y(); y < pMax.y(); y += 2*infillDistance) {
-	      poly.addVertex(x, y);
-	      poly.addVertex(x2, y+infillDistance);
-	      ymax = y;
-	    }
-	    for (double y = ymax; y > pMin.y(); y -= 2*infillDistance) {
-	      poly.addVertex(x2, y+infillDistance);
-	      poly.addVertex(x2+infillDistance, y);
-	    }
-	    x += 2*infillDistance;
-	  } else {      // normal line infill
-	    if (count%2){
-	      poly.addVertex(x,  pMin.y());
-	      poly.addVertex(x2, pMin.y());
-	    } else {
-	      poly.addVertex(x,  pMax.y());
-	      poly.addVertex(x2, pMax.y());
-	    }
-	    x += infillDistance;
+	  double ymax=pMax.y();;
+	  for (double y = pMin.y(); y < pMax.y(); y += 2*infillDistance) {
+	    poly.addVertex(x, y);
+	    poly.addVertex(x2, y+infillDistance);
+	    ymax = y;
+	  }
+	  for (double y = ymax; y > pMin.y(); y -= 2*infillDistance) {
+	    poly.addVertex(x2, y+infillDistance);
+	    poly.addVertex(x2+infillDistance, y);
 	  }
-	  count ++;
+	  x += 2*infillDistance;
 	}
 	poly.addVertex(pMax.x(), pMin.y()-infillDistance);
 	poly.addVertex(pMin.x(), pMin.y()-infillDistance);
-	// Poly poly2 = poly; poly2.move(Vector2d(infillDistance/2,0));
-	if (!zigzag)
-	  poly.rotate(center,m_angle);
-	// poly2.rotate(center,rotation);
 	vector<Poly> polys(1);
 	polys[0] = poly;
-	// polys[1] = poly2;
 	cpolys = Clipping::getClipperPolygons(polys);
       }
       break;
@@ -414,156 +424,182 @@ ClipperLib::Paths Infill::makeInfillPattern(InfillType type,
       cerr << "infill type " << type << " unknown "<< endl;
     }
   // save
-  //tid = omp_get_thread_num( );
-  //cerr << "thread "<<tid << " saving pattern " << endl;
-  //cerr << "cpolys " << cpolys.size() << endl;
-  if (type != PolyInfill &&
-      type != ZigzagInfill &&
-      type != ThinInfill ) // can't save these
-    {
-      struct pattern newPattern;
-      newPattern.type=type;
-      newPattern.angle=m_angle;
-      newPattern.distance=infillDistance;
-      newPattern.cpolys=cpolys;
-      newPattern.Min=Min;
-      newPattern.Max=Max;
-      savedPatterns.push_back(newPattern);
-      //cerr << "saved pattern " << endl;
-    }
+  if (saved) {
+    saved->cpolys.swap(cpolys);
+    g_atomic_int_set(&saved->ready, 1);
+    return saved->cpolys;
+  }
   return cpolys;
 }
 
 
-int smallest(const vector<double> &nums, double &minimum)
+// polygon edge in the scan frame where the lines are vertical, x0 <= x1
+struct ScanEdge {
+  double x0, y0, x1, y1;
+  bool operator<(const ScanEdge &o) const { return x0 < o.x0; };
+  double y(double x) const { return y0 + (x-x0)*(y1-y0)/(x1-x0); };
+};
+
+// the edges of polys rotated by -angle, sorted by x0
+static void scan_edges(const vector<Poly> &polys, double cosa, double sina,
+		       vector<ScanEdge> &edges)
 {
-  minimum = INFTY;
-  int minind = -1;
-  for (uint i = 0; i < nums.size(); i++ ) {
-    if (nums[i] < minimum) {
-      minimum = nums[i];
-      minind = i;
+  for (uint j = 0; j < polys.size(); j++) {
+    const vector<Vector2d> &v = polys[j].vertices;
+    const uint n = v.size();
+    if (n < 2) continue;
+    for (uint i = 0; i < n; i++) {
+      const Vector2d &a = v[i], &b = v[(i+1)%n];
+      ScanEdge e = { a.x()*cosa + a.y()*sina, -a.x()*sina + a.y()*cosa,
+		     b.x()*cosa + b.y()*sina, -b.x()*sina + b.y()*cosa };
+      if (e.x1 < e.x0) {
+	std::swap(e.x0, e.x1);
+	std::swap(e.y0, e.y1);
+      }
+      edges.push_back(e);
     }
   }
-  return minind;
+  std::sort(edges.begin(), edges.end());
 }
 
-bool intersectsPolys(const Vector2d &P1, const Vector2d &P2,
-		     const vector<Poly> &polys, double err=0.01)
+static inline double orientation(double ax, double ay, double bx, double by,
+				 double cx, double cy)
 {
-  Intersection inter;
-  for (size_t ci = 0; ci < polys.size(); ci++) {
-    // bool in1 = polys[ci].vertexInside(P1);
-    // bool in2 = polys[ci].vertexInside(P2);
-    // if (in1 != in2) return true;
-    vector<Intersection> inter = polys[ci].lineIntersections(P1, P2, err);
-    if (inter.size() > 0) {
-      return true;
-    }
+  return (bx-ax)*(cy-ay) - (by-ay)*(cx-ax);
+}
+
+// does a--b properly cross one of the edges
+static bool crosses_edges(const Vector2d &a, const Vector2d &b,
+			  const vector<const ScanEdge*> &edges)
+{
+  const double xmin = min(a.x(), b.x()), xmax = max(a.x(), b.x());
+  for (uint i = 0; i < edges.size(); i++) {
+    const ScanEdge &e = *edges[i];
+    if (e.x1 < xmin || e.x0 > xmax) continue;
+    const double d1 = orientation(a.x(), a.y(), b.x(), b.y(), e.x0, e.y0);
+    const double d2 = orientation(a.x(), a.y(), b.x(), b.y(), e.x1, e.y1);
+    if (d1*d2 >= 0) continue;
+    const double d3 = orientation(e.x0, e.y0, e.x1, e.y1, a.x(), a.y());
+    const double d4 = orientation(e.x0, e.y0, e.x1, e.y1, b.x(), b.y());
+    if (d3*d4 < 0) return true;
   }
   return false;
 }
 
-// sort (parallel) lines into polys so that each poly can be an extrusion path
-// polys will later be connected by moves (as printlines)
-// that is: connect nearest lines, but when connection intersects anything,
-//          start a new path (poly)
-vector<Poly> Infill::sortedpolysfromlines(const vector<infillline> &lines, double z)
+struct ScanSegment { double lo, hi; };
+
+// Sweep vertical lines at multiples of distance (the same positions on
+// all layers) through the polys rotated by -m_angle. The sorted crossings
+// of each line with the active edges give its segments (evenodd).
+// A segment continues the path of the overlapping segment of the previous
+// line nearest to its start if that path ends nearest to it, in the other
+// direction, and if the connection stays inside the polys.
+vector<Poly> Infill::scanlineFill(double z, const vector<Poly> &polys,
+				  double distance) const
 {
-  vector<Poly> polys;
-  uint count = lines.size();
-  if (count == 0) return polys;
-  vector<Poly> clippolys = Clipping::getOffset(m_tofillpolys,0.1);
-
-  vector<bool> done(count);
-  for (uint i = 0; i < count; i++ ) done[i] = false;
-  Poly p(z, extrusionfactor);
-  p.setClosed(false);
-  p.addVertex(lines[0].from);
-  p.addVertex(lines[0].to);
-  uint donelines = 1;
-  while(donelines < count)
-    {
-      vector<double> dist(4);
-      Vector2d l1,l2;
-      double mindistline = INFTY;
-      uint minindline = 0;
-      uint minind = 0;
-      double mindist = INFTY;
-      // find nearest line for current p endpoints:
-      for (uint j = 1; j < count; j++)
-	if (!done[j]) {
-	  dist[0] = (p.front()-lines[j].from).squared_length();
-	  dist[1] = (p.front()-lines[j].to  ).squared_length();
-	  dist[2] = (p.back() -lines[j].from).squared_length();
-	  dist[3] = (p.back() -lines[j].to  ).squared_length();
-	  uint mind = smallest(dist, mindist);
-	  if (mindist < mindistline) {
-	    minindline = j;
-	    mindistline = mindist;
-	    minind = mind;
-	  }
-	}
-      uint i = minindline;
-      // make new line l1--l2:
-      if (minind % 2 == 0) { l1 = lines[i].from; l2 = lines[i].to; }
-      else                 { l1 = lines[i].to; l2 = lines[i].from; }
-
-      // connection to last/first
-      Vector2d conn1, conn2 = l1;
-      if (minind < 2) conn1 = p.front();
-      else            conn1 = p.back();
-
-      // try polygons intersect
-      bool intersects = intersectsPolys(conn1, conn2, clippolys);
-
-      if (!intersects) {
-        // detect crossings: try intersect with any line
-      	Intersection inter;
-      	for (uint li = 0; li<lines.size(); li++) {
-      	  if (IntersectXY(conn1, conn2, lines[li].from, lines[li].to, inter,
-			  infillDistance/2.))  {
-            double t = conn2.x() - conn1.x();
-            if (t != 0)
-              t = (inter.p.x() - conn1.x()) / t;
-
-	    // don't catch endpoint intersections (continuations)
-	    if (t > 0.1 && t < 0.9) {
-		intersects = true;
-		break;
-      	    }
-          }
-      	}
+  vector<Poly> result;
+  if (distance <= 0) return result;
+  const double cosa = cos(m_angle), sina = sin(m_angle);
+  vector<ScanEdge> edges;
+  scan_edges(polys, cosa, sina, edges);
+  if (edges.size() == 0) return result;
+  vector<ScanEdge> clipedges; // connections must not leave these
+  scan_edges(Clipping::getOffset(polys, 0.1), cosa, sina, clipedges);
+
+  double xmax = edges[0].x1;
+  for (uint i = 1; i < edges.size(); i++)
+    xmax = max(xmax, edges[i].x1);
+  const long kmin = (long)ceil(edges[0].x0/distance);
+  const long kmax = (long)floor(xmax/distance);
+
+  vector<const ScanEdge*> active, clipactive;
+  uint nextedge = 0, nextclip = 0;
+  vector<double> ys;
+  vector<ScanSegment> prev, cur;
+  vector<int> prevpath, curpath; // path of each segment
+  vector<int> prevfirst, prevlast; // overlapping segments of the other line
+  vector<int> curfirst, curlast;
+  vector< vector<Vector2d> > paths;
+  for (long k = kmin; k <= kmax; k++) {
+    const double x = k*distance;
+    while (nextedge < edges.size() && edges[nextedge].x0 <= x)
+      active.push_back(&edges[nextedge++]);
+    ys.clear();
+    uint na = 0;
+    for (uint i = 0; i < active.size(); i++)
+      if (active[i]->x1 > x) { // half open, vertices are counted once
+	ys.push_back(active[i]->y(x));
+	active[na++] = active[i];
       }
-
-      if (intersects) { // start new poly
-	if (p.size() > 0) {
-	  p.cleanup(infillDistance/2.);
-	  polys.push_back(p);
-	}
-	p = Poly(z, extrusionfactor);
-	p.setClosed(false);
+    active.resize(na);
+    std::sort(ys.begin(), ys.end());
+    cur.clear();
+    for (uint i = 0; i+1 < ys.size(); i += 2)
+      if (ys[i+1] > ys[i]) {
+	ScanSegment seg = { ys[i], ys[i+1] };
+	cur.push_back(seg);
+      }
+    // clip edges between the previous line and this one
+    while (nextclip < clipedges.size() && clipedges[nextclip].x0 <= x)
+      clipactive.push_back(&clipedges[nextclip++]);
+    na = 0;
+    for (uint i = 0; i < clipactive.size(); i++)
+      if (clipactive[i]->x1 >= x-distance)
+	clipactive[na++] = clipactive[i];
+    clipactive.resize(na);
+
+    // overlaps with the previous line, both are sorted
+    prevfirst.assign(prev.size(), -1);
+    prevlast.assign(prev.size(), -1);
+    curfirst.assign(cur.size(), -1);
+    curlast.assign(cur.size(), -1);
+    uint j0 = 0;
+    for (uint i = 0; i < prev.size(); i++) {
+      while (j0 < cur.size() && cur[j0].hi <= prev[i].lo) j0++;
+      for (uint j = j0; j < cur.size() && cur[j].lo < prev[i].hi; j++) {
+	if (prevfirst[i] < 0) prevfirst[i] = j;
+	prevlast[i] = j;
+	if (curfirst[j] < 0) curfirst[j] = i;
+	curlast[j] = i;
       }
-      // add new line to current p
-      if (minind < 2) { p.push_front(l1); p.push_front(l2); }
-      else            { p.push_back(l1);  p.push_back(l2);  }
-      done[i] = true;
-      donelines++;
     }
-  if (p.size() > 0) {
-    p.cleanup(infillDistance/2.);
-    polys.push_back(p);
+    const bool up = (k%2 == 0);
+    // the previous path ends at the bottom when this line goes up
+    const vector<int> &prevnext = up ? prevfirst : prevlast;
+    const vector<int> &curprev  = up ? curfirst  : curlast;
+    curpath.assign(cur.size(), -1);
+    for (uint j = 0; j < cur.size(); j++) {
+      const Vector2d from(x, up ? cur[j].lo : cur[j].hi),
+	to(x, up ? cur[j].hi : cur[j].lo);
+      int path = -1;
+      if (curprev[j] >= 0 && prevnext[curprev[j]] == (int)j) {
+	path = prevpath[curprev[j]];
+	if (crosses_edges(paths[path].back(), from, clipactive))
+	  path = -1;
+      }
+      if (path < 0) {
+	path = paths.size();
+	paths.push_back(vector<Vector2d>());
+      }
+      paths[path].push_back(from);
+      paths[path].push_back(to);
+      curpath[j] = path;
+    }
+    prev.swap(cur);
+    prevpath.swap(curpath);
   }
-  return polys;
-}
 
-bool sameAngle(double angle1, double angle2, double err)
-{
-  while (angle1 < 0) angle1+=2.*M_PI;
-  while (angle2 < 0) angle2+=2.*M_PI;
-  while (angle1 >= 2*M_PI) angle1-=2.*M_PI;
-  while (angle2 >= 2*M_PI) angle2-=2.*M_PI;
-  return (abs(angle1-angle2) < err);
+  result.resize(paths.size(), Poly(z, extrusionfactor));
+  for (uint i = 0; i < paths.size(); i++) {
+    result[i].setClosed(false);
+    result[i].vertices.resize(paths[i].size());
+    for (uint v = 0; v < paths[i].size(); v++) {
+      const Vector2d &p = paths[i][v];
+      result[i].vertices[v] = Vector2d(p.x()*cosa - p.y()*sina,
+				       p.x()*sina + p.y()*cosa);
+    }
+  }
+  return result;
 }
 
 
@@ -572,36 +608,8 @@ void Infill::addInfillPolys(const vector<Poly> &polys)
   if (polys.size() == 0) return;
 #define NEWINFILL 1
 #if NEWINFILL
-  switch (m_type) {
-  case BridgeInfill:
-  case RaftInfill:
-  case ParallelInfill:
-    {
-      vector<infillline> lines;
-      const Vector2d UNITX(1,0);
-      for (uint j = 0; j < polys.size(); j++) {
-  	for (uint i = 0; i < polys[j].size() ; i++ )
-  	  {
-	    Vector2d l = (polys[j][i+1] - polys[j][i]);
-	    double langle = angleBetween(UNITX, l) + M_PI/2;
-	    if (sameAngle(langle,      m_angle, 0.2) ||
-		sameAngle(langle+M_PI, m_angle, 0.2))
-  	      {
-		infillline il = { polys[j][i], polys[j][i+1] };
-  		lines.push_back( il );;
-  	      }
-  	  }
-      }
-      infillpolys = sortedpolysfromlines(lines, polys.back().getZ());
-      break;
-    }
-  default:
-#endif
-#if NEWINFILL
-    infillpolys = polys;
-    // Poly newpoly(p.getZ(), extrusionfactor);
-    // infillpolys.push_back(newpoly);
-  }
+  // line types are made by scanlineFill and don't get here
+  infillpolys = polys;
 #else
   for (uint i=0; i<polys.size();i++)
     addInfillPoly(polys[i]);
@@ -681,16 +689,14 @@ void Infill::getLines(vector<Vector3d> &lines) const
 vector<Poly> Infill::getCachedPattern(double z) {
   vector<Poly> cached;
   if (m_type != PolyInfill) // can't save PolyInfill
-    if (savedPatterns.size()>0)
-      for (vector<struct pattern>::iterator sIt=savedPatterns.begin();
-      	   sIt != savedPatterns.end(); sIt++)
-	if (sIt->type == m_type &&
-	    abs(sIt->distance-infillDistance) < 0.01 &&
-	    abs(sIt->angle-m_angle) < 0.01 )
-	  {
-	    cached = Clipping::getPolys(sIt->cpolys,z,extrusionfactor);
-	    break;
-	  }
+    for (const pattern *p = (const pattern*) g_atomic_pointer_get(&savedPatterns);
+	 p != NULL; p = p->next)
+      if (p->matches(m_type, infillDistance, m_angle) &&
+	  g_atomic_int_get(&p->ready))
+	{
+	  cached = Clipping::getPolys(p->cpolys,z,extrusionfactor);
+	  break;
+	}
   return cached;
 };
 
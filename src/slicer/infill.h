@@ -20,9 +20,6 @@
 #pragma once
 
 /* #include <glib/gi18n.h> */
-#ifdef _OPENMP
-#include <omp.h>
-#endif
 
 #include "stdafx.h"
 #include "clipping.h"
@@ -41,6 +38,9 @@ class Infill
 {
   Layer *layer;
 
+  // Saved patterns are a list that is only prepended to while slicing,
+  // so lookups need no lock. A pattern is published before it is made
+  // (ready is 0) so that no other thread makes the same one again.
   struct pattern
   {
     InfillType type;
@@ -48,18 +48,30 @@ class Infill
     double distance;
     Vector2d Min,Max;
     ClipperLib::Paths cpolys;
+    gint ready;
+    pattern *next; // older patterns
+
+    bool matches(InfillType type, double distance, double angle) const;
+    bool covers(const Vector2d &Min, const Vector2d &Max) const;
   } ;
 
-  static vector<struct pattern> savedPatterns;
-#ifdef _OPENMP
-  static omp_lock_t save_lock;
-#endif
+  static pattern *savedPatterns; // newest first
+
+  static pattern *getPattern(InfillType type, double distance, double angle,
+			     const Vector2d &Min, const Vector2d &Max,
+			     bool &isnew);
 
-  ClipperLib::Paths makeInfillPattern(InfillType type,
-					 const vector<Poly> &tofillpolys,
-					 double infillDistance,
-					 double offsetDistance,
-					 double rotation) ;
+  // returns the saved pattern or cpolys with a pattern that can't be saved
+  const ClipperLib::Paths &makeInfillPattern(InfillType type,
+					     const vector<Poly> &tofillpolys,
+					     double infillDistance,
+					     double offsetDistance,
+					     double rotation,
+					     ClipperLib::Paths &cpolys);
+
+  // lines in direction m_angle, ordered and joined to zigzag paths
+  vector<Poly> scanlineFill(double z, const vector<Poly> &polys,
+			    double distance) const;
 
   Infill();
 
@@ -104,9 +116,6 @@ class Infill
 
   void getLines(vector<Vector3d> &lines) const;
 
-  typedef struct { Vector2d from; Vector2d to; } infillline;
-  vector<Poly> sortedpolysfromlines(const vector<infillline> &lines, double z);
-
   void clear();
   uint size() const {return infillpolys.size();};
 
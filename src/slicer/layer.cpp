@@ -148,19 +148,27 @@ bool Layer::pointInPolygons(const Vector2d &p) const
 
 
 int Layer::addShape(const Matrix4d &T, const Shape &shape, double z,
-		    double &max_gradient, double max_supportangle)
+		    double &max_gradient, double max_supportangle,
+		    TriangleSweep *sweep,
+		    const vector<Matrix4d> *instances)
 {
   double hackedZ = z;
   bool polys_ok = false;
   vector<Poly> polys;
   int num_polys=-1;
+  uint first_support = toSupportPolygons.size(); // of the last attempt
+  // the sweep window covers support below z and hacked z above
+  const vector<uint> *triangle_indices = NULL;
+  if (sweep)
+    triangle_indices = &sweep->advance(z-thickness, z+thickness);
   // try to slice until polygons can be made, otherwise hack z
   while (!polys_ok && hackedZ < z+thickness) {
     polys.clear();
+    first_support = toSupportPolygons.size();
     polys_ok = shape.getPolygonsAtZ(T, hackedZ,  // slice shape at hackedZ
 				    polys, max_gradient,
 				    toSupportPolygons, max_supportangle,
-				    thickness);
+				    thickness, triangle_indices);
     hackedZ += thickness/10;
     if (polys_ok) {
       num_polys = polys.size();
@@ -170,6 +178,21 @@ int Layer::addShape(const Matrix4d &T, const Shape &shape, double z,
       cerr << "hacked Z " << z << " -> " << hackedZ << endl;
     }
   }
+  // the slices of the instances are moved copies of the successful one
+  if (instances && polys_ok) {
+    const uint num_support = toSupportPolygons.size();
+    for (uint i = 0; i < instances->size(); i++) {
+      const Matrix4d &R = (*instances)[i];
+      for (uint p = 0; p < polys.size(); p++) {
+	polygons.push_back(polys[p]);
+	polygons.back().transform(R);
+      }
+      for (uint p = first_support; p < num_support; p++) {
+	toSupportPolygons.push_back(toSupportPolygons[p]);
+	toSupportPolygons.back().transform(R);
+      }
+    }
+  }
   cleanupPolygons();
   return num_polys;
 }
@@ -753,6 +776,7 @@ void Layer::MakePrintlines(Vector3d &lastPos, //GCodeState &state,
   const double cornerradius   = linewidth*settings.get_double("Slicing","CornerRadius");
 
   const bool clipnearest      = settings.get_boolean("Slicing","MoveNearest");
+  const bool clipshortest     = settings.get_boolean("Slicing","MoveShortest");
 
   const uint supportExtruder  = settings.GetSupportExtruder();
   const double minshelltime   = settings.get_double("Slicing","MinShelltime");
@@ -773,7 +797,10 @@ void Layer::MakePrintlines(Vector3d &lastPos, //GCodeState &state,
 
   // polys to keep line movements inside
   //const vector<Poly> * clippolys = &polygons;
-  const vector<Poly> * clippolys = GetOuterShell();
+  const PolyLocator clippolys(*GetOuterShell());
+  // built when used, the shells simplified a bit
+  CombingGraph combinggraph(*GetOuterShell(), 0.25*linewidth);
+  CombingGraph *combing = clipshortest ? &combinggraph : NULL;
 
   // 1. Skins, all but last, because they are the lowest lines, below layer Z
   if (skins > 1) {
@@ -807,7 +834,7 @@ void Layer::MakePrintlines(Vector3d &lastPos, //GCodeState &state,
 	// have to get all these separately because z changes
 	printlines.makeLines(startPoint, lines);
 	if (!ZliftAlways)
-	  printlines.clipMovements(*clippolys, lines, clipnearest, linewidth);
+	  printlines.clipMovements(clippolys, lines, clipnearest, linewidth, combing);
 	printlines.optimize(linewidth,
 			    minshelltime, cornerradius, lines);
 	printlines.getLines(lines, lines3, extr_per_mm);
@@ -864,10 +891,15 @@ void Layer::MakePrintlines(Vector3d &lastPos, //GCodeState &state,
   Command lchange(LAYERCHANGE, LayerNo);
   lchange.where = Vector3d(0.,0.,Z);
   lchange.comment += info();
+  if (printlines.getTravelSaved() > 0) {
+    ostringstream ostr;
+    ostr << ", travel saved " << printlines.getTravelSaved() << "mm";
+    lchange.comment += ostr.str();
+  }
   lines3.push_back(PLine3(lchange));
 
   if (!ZliftAlways)
-    printlines.clipMovements(*clippolys, lines, clipnearest, linewidth);
+    printlines.clipMovements(clippolys, lines, clipnearest, linewidth, combing);
   printlines.optimize(linewidth,
 		      settings.get_double("Slicing","MinLayertime"),
 		      cornerradius, lines);
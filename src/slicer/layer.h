@@ -154,8 +154,12 @@ public:
 
   void addPolygons(vector<Poly> &polys);
   void cleanupPolygons();
+  // instances are copies of the shape, their transformation is
+  // R*T with each R a rotation about z and a move in xy
   int addShape(const Matrix4d &T, const Shape &shape, double z,
-	       double &max_gradient, double max_supportangle);
+	       double &max_gradient, double max_supportangle,
+	       TriangleSweep *sweep = NULL,
+	       const vector<Matrix4d> *instances = NULL);
 
   double area() const;
 
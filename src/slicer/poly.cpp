@@ -822,6 +822,334 @@ void Poly::move(vector<Poly> &polys, const Vector2d &trans)
 
 
 
+///////////////////////////  PolyLocator  ////////////////////////////////////////
+
+// about one item per cell
+static double grid_cellsize(double width, double height, uint items)
+{
+  double cellsize = (width*height > 0) ? sqrt(width*height/items)
+    : max(width, height)/items;
+  return (cellsize > 0) ? cellsize : 1.;
+}
+
+static uint grid_cells(double extent, double cellsize)
+{
+  return min((uint)(extent/cellsize) + 1, 4096u);
+}
+
+PolyLocator::PolyLocator(const vector<Poly> &polys_)
+  : polys(polys_), cellsize(1.), nx(0), ny(0), bcellsize(1.), bnx(0), bny(0)
+{
+  const uint npolys = polys.size();
+  Min = Vector2d(INFTY, INFTY);
+  Max = Vector2d(-INFTY, -INFTY);
+  bbox.resize(2*npolys);
+  uint nedges = 0;
+  for (uint p = 0; p < npolys; p++) {
+    Vector2d &pmin = bbox[2*p], &pmax = bbox[2*p+1];
+    pmin = Vector2d(INFTY, INFTY);
+    pmax = Vector2d(-INFTY, -INFTY);
+    const vector<Vector2d> &v = polys[p].vertices;
+    for (uint i = 0; i < v.size(); i++) {
+      pmin.x() = min(pmin.x(), v[i].x()); pmax.x() = max(pmax.x(), v[i].x());
+      pmin.y() = min(pmin.y(), v[i].y()); pmax.y() = max(pmax.y(), v[i].y());
+    }
+    if (v.size() < 2) continue; // never inside
+    nedges += v.size();
+    Min.x() = min(Min.x(), pmin.x()); Max.x() = max(Max.x(), pmax.x());
+    Min.y() = min(Min.y(), pmin.y()); Max.y() = max(Max.y(), pmax.y());
+  }
+
+  vgrids.resize(npolys);
+  vcellstart.push_back(0);
+  for (uint p = 0; p < npolys; p++)
+    buildVertexGrid(p);
+  buildBoxGrid();
+
+  if (nedges == 0) return;
+  cellsize = grid_cellsize(Max.x()-Min.x(), Max.y()-Min.y(), nedges);
+  nx = grid_cells(Max.x()-Min.x(), cellsize);
+  ny = grid_cells(Max.y()-Min.y(), cellsize);
+  // horizontal edges are never crossed and left out
+  rowstart.assign(ny+1, 0);
+  for (uint pass = 0; pass < 2; pass++) {
+    vector<uint> fill(rowstart.begin(), rowstart.end()-1);
+    for (uint p = 0; p < npolys; p++) {
+      const vector<Vector2d> &v = polys[p].vertices;
+      const uint N = v.size();
+      if (N < 2) continue;
+      for (uint i = 1; i <= N; i++) {
+	const Vector2d &p1 = v[i-1], &p2 = v[i % N];
+	if (p1.y() == p2.y()) continue;
+	const uint r0 = row(min(p1.y(), p2.y())), r1 = row(max(p1.y(), p2.y()));
+	if (pass == 0) {
+	  for (uint r = r0; r <= r1; r++) rowstart[r+1]++;
+	} else {
+	  Edge edge;
+	  edge.col = col(max(p1.x(), p2.x()));
+	  edge.poly = p;
+	  edge.index = i;
+	  for (uint r = r0; r <= r1; r++) edges[fill[r]++] = edge;
+	}
+      }
+    }
+    if (pass == 0) {
+      for (uint r = 0; r < ny; r++) rowstart[r+1] += rowstart[r];
+      edges.resize(rowstart[ny]);
+    }
+  }
+  for (uint r = 0; r < ny; r++)
+    std::sort(edges.begin()+rowstart[r], edges.begin()+rowstart[r+1]);
+}
+
+uint PolyLocator::row(double y) const
+{
+  const double r = floor((y - Min.y())/cellsize);
+  if (r < 0) return 0;
+  if (r >= ny) return ny-1;
+  return (uint)r;
+}
+
+uint PolyLocator::col(double x) const
+{
+  const double c = floor((x - Min.x())/cellsize);
+  if (c < 0) return 0;
+  if (c >= nx) return nx-1;
+  return (uint)c;
+}
+
+// the crossings counted by Poly::vertexInside, only for edges whose
+// right end is not left of p
+void PolyLocator::polysAt(const Vector2d &p, vector<uint> &result) const
+{
+  result.clear();
+  if (nx == 0 || !(p.y() > Min.y() && p.y() <= Max.y() && p.x() <= Max.x()))
+    return;
+  const uint r = row(p.y());
+  Edge first;
+  first.col = col(p.x());
+  first.poly = first.index = 0;
+  const vector<Edge>::const_iterator end = edges.begin()+rowstart[r+1];
+  vector<uint> crossing;
+  for (vector<Edge>::const_iterator e =
+	 std::lower_bound(edges.begin()+rowstart[r], end, first); e != end; ++e) {
+    const vector<Vector2d> &v = polys[e->poly].vertices;
+    const Vector2d *p1 = &v[e->index-1], *p2 = &v[e->index % v.size()];
+    if (p.y() > min(p1->y(), p2->y())) {
+      if (p.y() <= max(p1->y(), p2->y())) {
+	if (p.x() <= max(p1->x(), p2->x())) {
+	  if (p1->y() != p2->y()) {
+	    const double xinters =
+	      (p.y()-p1->y())*(p2->x()-p1->x())/(p2->y()-p1->y())+p1->x();
+	    if (p1->x() == p2->x() || p.x() <= xinters)
+	      crossing.push_back(e->poly);
+	  }
+	}
+      }
+    }
+  }
+  std::sort(crossing.begin(), crossing.end());
+  for (uint i = 0; i < crossing.size(); ) {
+    uint j = i+1;
+    while (j < crossing.size() && crossing[j] == crossing[i]) j++;
+    if ((j-i) % 2 != 0) result.push_back(crossing[i]);
+    i = j;
+  }
+}
+
+int PolyLocator::polyAt(const Vector2d &p) const
+{
+  vector<uint> inside;
+  polysAt(p, inside);
+  return inside.empty() ? -1 : (int)inside.front();
+}
+
+bool PolyLocator::nearSegment(uint i, const Vector2d &a, const Vector2d &b,
+			      double margin) const
+{
+  const Vector2d &pmin = bbox[2*i], &pmax = bbox[2*i+1];
+  return !(max(a.x(), b.x()) + margin < pmin.x() ||
+	   min(a.x(), b.x()) - margin > pmax.x() ||
+	   max(a.y(), b.y()) + margin < pmin.y() ||
+	   min(a.y(), b.y()) - margin > pmax.y());
+}
+
+// every poly in all cells its bounding box touches
+void PolyLocator::buildBoxGrid()
+{
+  BMin = Vector2d(INFTY, INFTY);
+  BMax = Vector2d(-INFTY, -INFTY);
+  uint nboxes = 0;
+  for (uint p = 0; p < polys.size(); p++) {
+    if (polys[p].size() == 0) continue;
+    nboxes++;
+    BMin.x() = min(BMin.x(), bbox[2*p].x());   BMin.y() = min(BMin.y(), bbox[2*p].y());
+    BMax.x() = max(BMax.x(), bbox[2*p+1].x()); BMax.y() = max(BMax.y(), bbox[2*p+1].y());
+  }
+  if (nboxes == 0) return;
+  bcellsize = grid_cellsize(BMax.x()-BMin.x(), BMax.y()-BMin.y(), nboxes);
+  bnx = grid_cells(BMax.x()-BMin.x(), bcellsize);
+  bny = grid_cells(BMax.y()-BMin.y(), bcellsize);
+  bcellstart.assign(bnx*bny+1, 0);
+  vector<uint> fill;
+  for (uint pass = 0; pass < 2; pass++) {
+    for (uint p = 0; p < polys.size(); p++) {
+      if (polys[p].size() == 0) continue;
+      const uint x0 = min((uint)((bbox[2*p].x()  -BMin.x())/bcellsize), bnx-1),
+	x1 = min((uint)((bbox[2*p+1].x()-BMin.x())/bcellsize), bnx-1),
+	y0 = min((uint)((bbox[2*p].y()  -BMin.y())/bcellsize), bny-1),
+	y1 = min((uint)((bbox[2*p+1].y()-BMin.y())/bcellsize), bny-1);
+      for (uint y = y0; y <= y1; y++)
+	for (uint x = x0; x <= x1; x++) {
+	  if (pass == 0) bcellstart[y*bnx+x+1]++;
+	  else bcells[fill[y*bnx+x]++] = p;
+	}
+    }
+    if (pass == 0) {
+      for (uint c = 0; c < bnx*bny; c++) bcellstart[c+1] += bcellstart[c];
+      bcells.resize(bcellstart.back());
+      fill.assign(bcellstart.begin(), bcellstart.end()-1);
+    }
+  }
+}
+
+void PolyLocator::polysNear(const Vector2d &a, const Vector2d &b,
+			    double margin, vector<uint> &result) const
+{
+  result.clear();
+  const double xmin = min(a.x(), b.x()) - margin, xmax = max(a.x(), b.x()) + margin,
+    ymin = min(a.y(), b.y()) - margin, ymax = max(a.y(), b.y()) + margin;
+  if (isnan(xmin) || isnan(xmax) || isnan(ymin) || isnan(ymax)) {
+    for (uint p = 0; p < polys.size(); p++) result.push_back(p);
+    return;
+  }
+  if (bnx == 0 || xmax < BMin.x() || xmin > BMax.x()
+      || ymax < BMin.y() || ymin > BMax.y())
+    return;
+  const uint x0 = (uint)CLAMP(floor((xmin-BMin.x())/bcellsize), 0., bnx-1.),
+    x1 = (uint)CLAMP(floor((xmax-BMin.x())/bcellsize), 0., bnx-1.),
+    y0 = (uint)CLAMP(floor((ymin-BMin.y())/bcellsize), 0., bny-1.),
+    y1 = (uint)CLAMP(floor((ymax-BMin.y())/bcellsize), 0., bny-1.);
+  for (uint y = y0; y <= y1; y++)
+    for (uint x = x0; x <= x1; x++)
+      for (uint k = bcellstart[y*bnx+x]; k < bcellstart[y*bnx+x+1]; k++)
+	if (nearSegment(bcells[k], a, b, margin))
+	  result.push_back(bcells[k]);
+  std::sort(result.begin(), result.end());
+  result.erase(std::unique(result.begin(), result.end()), result.end());
+}
+
+// all vertices of closed polys, the ends of open ones
+void PolyLocator::buildVertexGrid(uint p)
+{
+  const Poly &poly = polys[p];
+  const uint n = poly.size();
+  VertexGrid &g = vgrids[p];
+  g.first = vcellstart.size()-1;
+  g.nx = g.ny = 0;
+  g.cellsize = 1.;
+  vector<uint> used;
+  for (uint i = 0; i < n; i++)
+    if (poly.isClosed() || i == 0 || i == n-1)
+      used.push_back(i);
+  if (used.empty()) return;
+  Vector2d vmin(INFTY, INFTY), vmax(-INFTY, -INFTY);
+  for (uint u = 0; u < used.size(); u++) {
+    const Vector2d &v = poly.vertices[used[u]];
+    vmin.x() = min(vmin.x(), v.x()); vmax.x() = max(vmax.x(), v.x());
+    vmin.y() = min(vmin.y(), v.y()); vmax.y() = max(vmax.y(), v.y());
+  }
+  g.Min = vmin;
+  g.cellsize = grid_cellsize(vmax.x()-vmin.x(), vmax.y()-vmin.y(), used.size());
+  g.nx = grid_cells(vmax.x()-vmin.x(), g.cellsize);
+  g.ny = grid_cells(vmax.y()-vmin.y(), g.cellsize);
+  vector<uint> cellof(used.size()), count(g.nx*g.ny, 0);
+  for (uint u = 0; u < used.size(); u++) {
+    const Vector2d &v = poly.vertices[used[u]];
+    const uint cx = min((uint)((v.x()-vmin.x())/g.cellsize), g.nx-1);
+    const uint cy = min((uint)((v.y()-vmin.y())/g.cellsize), g.ny-1);
+    cellof[u] = cy*g.nx + cx;
+    count[cellof[u]]++;
+  }
+  for (uint c = 0; c < count.size(); c++)
+    vcellstart.push_back(vcellstart.back() + count[c]);
+  vcells.resize(vcellstart.back());
+  vector<uint> fill(vcellstart.begin()+g.first, vcellstart.end()-1);
+  for (uint u = 0; u < used.size(); u++)
+    vcells[fill[cellof[u]]++] = used[u];
+}
+
+void PolyLocator::nearestInCell(uint poly, uint cell, const Vector2d &p,
+				double &mindist, int &nearest) const
+{
+  const vector<Vector2d> &v = polys[poly].vertices;
+  const uint first = vgrids[poly].first + cell;
+  for (uint k = vcellstart[first]; k < vcellstart[first+1]; k++) {
+    const int j = vcells[k];
+    const double d = p.squared_distance(v[j]);
+    if (d < mindist || (d == mindist && j < nearest)) {
+      mindist = d;
+      nearest = j;
+    }
+  }
+}
+
+// nearest vertex of the grid, the lowest index of equally near ones;
+// rings of cells around p until no vertex outside can be nearer
+int PolyLocator::nearestVertex(uint poly, const Vector2d &p,
+			       double &mindist) const
+{
+  mindist = INFTY;
+  const VertexGrid &g = vgrids[poly];
+  const int nx = g.nx, ny = g.ny;
+  const double fx = floor((p.x()-g.Min.x())/g.cellsize),
+    fy = floor((p.y()-g.Min.y())/g.cellsize);
+  if (nx == 0 || isnan(fx) || isnan(fy)) return -1;
+  const int cx = (int)CLAMP(fx, 0., nx-1.), cy = (int)CLAMP(fy, 0., ny-1.);
+  int nearest = -1;
+  for (int r = 0; ; r++) {
+    const int x0 = cx-r, x1 = cx+r, y0 = cy-r, y1 = cy+r;
+    for (int y = max(y0, 0); y <= min(y1, ny-1); y++) {
+      if (y == y0 || y == y1) {
+	for (int x = max(x0, 0); x <= min(x1, nx-1); x++)
+	  nearestInCell(poly, y*nx + x, p, mindist, nearest);
+      } else {
+	if (x0 >= 0) nearestInCell(poly, y*nx + x0, p, mindist, nearest);
+	if (x1 < nx && x1 != x0)
+	  nearestInCell(poly, y*nx + x1, p, mindist, nearest);
+      }
+    }
+    if (x0 <= 0 && y0 <= 0 && x1 >= nx-1 && y1 >= ny-1) break;
+    if (nearest >= 0) { // distance to the cells outside the ring
+      double bound = INFTY;
+      if (x0 > 0)    bound = min(bound, p.x() - (g.Min.x() + x0*g.cellsize));
+      if (x1 < nx-1) bound = min(bound, g.Min.x() + (x1+1)*g.cellsize - p.x());
+      if (y0 > 0)    bound = min(bound, p.y() - (g.Min.y() + y0*g.cellsize));
+      if (y1 < ny-1) bound = min(bound, g.Min.y() + (y1+1)*g.cellsize - p.y());
+      if (bound > 0 && mindist < bound*bound) break;
+    }
+  }
+  return nearest;
+}
+
+void PolyLocator::nearestIndices(uint from, uint to,
+				 int &fromindex, int &toindex) const
+{
+  const Poly &poly = polys[from];
+  double mindist = INFTY;
+  for (uint i = 0; i < poly.size(); i++) {
+    if (!poly.isClosed() && i != 0 && i != poly.size()-1) continue;
+    double d;
+    const int j = nearestVertex(to, poly.vertices[i], d);
+    if (j >= 0 && d < mindist) {
+      mindist = d;
+      fromindex = i;
+      toindex = j;
+    }
+  }
+}
+
+
 ///////////////////////////  ExPoly  /////////////////////////////////////////////
 
 void ExPoly::clear()
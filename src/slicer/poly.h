@@ -152,6 +152,74 @@ public:
 };
 
 
+////////////////////////////////////////////////////////////////////
+
+// Point location in a set of polys, built once for many queries. The
+// edges are bucketed in a uniform grid, in every row they span and at the
+// column of their right end, so the ray cast of Poly::vertexInside only
+// visits the cells of one row right of the point. Results are the same
+// as those of Poly::vertexInside and Poly::nearestIndices.
+class PolyLocator
+{
+public:
+  PolyLocator(const vector<Poly> &polys);
+
+  // all polys containing p, ascending
+  void polysAt(const Vector2d &p, vector<uint> &result) const;
+  // first poly containing p, -1 if none
+  int polyAt(const Vector2d &p) const;
+  // bounding box of poly i touches the box of segment a-b widened by margin
+  bool nearSegment(uint i, const Vector2d &a, const Vector2d &b,
+		   double margin) const;
+  // all polys near segment a-b, ascending
+  void polysNear(const Vector2d &a, const Vector2d &b, double margin,
+		 vector<uint> &result) const;
+  // nearest vertices of two polys, as Poly::nearestIndices
+  void nearestIndices(uint from, uint to, int &fromindex, int &toindex) const;
+
+  const vector<Poly> &polys;
+
+private:
+  struct Edge {
+    uint col, poly, index; // edge from vertex index-1 to index%size
+    bool operator<(const Edge &o) const {
+      if (col != o.col) return col < o.col;
+      if (poly != o.poly) return poly < o.poly;
+      return index < o.index;
+    };
+  };
+  Vector2d Min, Max;
+  double cellsize;
+  uint nx, ny;
+  vector<uint> rowstart; // edges of row r from rowstart[r]
+  vector<Edge> edges;
+  vector<Vector2d> bbox; // min and max of each poly
+
+  // coarser grid of the polys by bounding box
+  Vector2d BMin, BMax;
+  double bcellsize;
+  uint bnx, bny;
+  vector<uint> bcellstart, bcells;
+  void buildBoxGrid();
+
+  // per poly grid of the vertices nearestIndices looks at
+  struct VertexGrid {
+    Vector2d Min;
+    double cellsize;
+    uint nx, ny, first; // first cell in vcellstart
+  };
+  vector<VertexGrid> vgrids;
+  vector<uint> vcellstart, vcells;
+
+  uint row(double y) const;
+  uint col(double x) const;
+  void buildVertexGrid(uint p);
+  int nearestVertex(uint poly, const Vector2d &p, double &mindist) const;
+  void nearestInCell(uint poly, uint cell, const Vector2d &p,
+		     double &mindist, int &nearest) const;
+};
+
+
 ////////////////////////////////////////////////////////////////////
 
 class ExPoly
@@ -23,6 +23,8 @@
 #include "gcode/gcodestate.h"
 #include "ui/progress.h"
 
+#include <map>
+
 
 
 //////// Generic PLine functions
@@ -529,10 +531,15 @@ string PLine2::info() const
 
 
 Printlines::Printlines(const Layer * layer, const Settings * settings, double z_offset)
-  : Zoffset(z_offset), name(""), slowdownfactor(1.)
+  : Zoffset(z_offset), name(""), slowdownfactor(1.), travelsaved(0.),
+    ordertimeleft(0)
 {
   this->settings = settings;
   this->layer = layer;
+  // shared by all makeLines calls of the layer
+  if (settings != NULL)
+    ordertimeleft = (unsigned long)
+      (1000*settings->get_double("Slicing","OptimizeOrderTime"));
 
   // save overhang polys of layer for point-in-overhang detection
   if (layer!=NULL) {
@@ -707,74 +714,391 @@ void Printlines::addPolys(PLineArea area,
 //   return (p1.getPriority() >= p2.getPriority());
 // }
 
+// The start vertices of polygons with the same priority in a uniform
+// grid: all vertices of closed polygons, the ends of open ones.
+// Vertices of done polygons are skipped.
+class PolyVertexGrid
+{
+public:
+  PolyVertexGrid(const vector<const Poly*> &polys, const vector<uint> &members,
+		 double priority);
+  // Nearest vertex by distance squared / priority if it is nearer than
+  // pdist, or as near and earlier in poly and vertex order.
+  void nearest(const Vector2d &p, const vector<bool> &done,
+	       double &pdist, int &poly, int &vertex) const;
+private:
+  struct PolyVertex { uint poly, vertex; Vector2d p; };
+  double priority;
+  Vector2d Min;
+  double cellsize;
+  int nx, ny;
+  vector<uint> cellstart; // vertices of cell c are from cellstart[c]
+  vector<PolyVertex> vertices;
+
+  int cell(double x, double min, int n) const {
+    const double c = floor((x-min)/cellsize);
+    if (!(c > 0)) return 0;
+    return (c < n-1) ? (int)c : n-1;
+  };
+  void nearestInCell(int x, int y, const Vector2d &p, const vector<bool> &done,
+		     double &pdist, int &poly, int &vertex) const;
+};
+
+PolyVertexGrid::PolyVertexGrid(const vector<const Poly*> &polys,
+			       const vector<uint> &members, double priority_)
+  : priority(priority_)
+{
+  vector<PolyVertex> all;
+  for (uint m = 0; m < members.size(); m++) {
+    const Poly &poly = *polys[members[m]];
+    const uint n = poly.size();
+    for (uint i = 0; i < n; i++) {
+      if (!poly.isClosed() && i != 0 && i != n-1) continue;
+      PolyVertex pv = { members[m], i, poly.vertices[i] };
+      all.push_back(pv);
+    }
+  }
+  const uint n = all.size();
+  Vector2d Max;
+  Min = Max = all[0].p;
+  for (uint i = 1; i < n; i++) {
+    Min = Vector2d(min(Min.x(), all[i].p.x()), min(Min.y(), all[i].p.y()));
+    Max = Vector2d(max(Max.x(), all[i].p.x()), max(Max.y(), all[i].p.y()));
+  }
+  // about 2 vertices per cell
+  const Vector2d diag = Max-Min;
+  cellsize = sqrt(2*max(diag.x(),0.01)*max(diag.y(),0.01)/n);
+  nx = min((int)(diag.x()/cellsize)+1, (int)n);
+  ny = min((int)(diag.y()/cellsize)+1, (int)n);
+  cellstart.assign(nx*ny+1, 0);
+  vector<uint> cells(n);
+  for (uint i = 0; i < n; i++) {
+    cells[i] = cell(all[i].p.y(), Min.y(), ny)*nx + cell(all[i].p.x(), Min.x(), nx);
+    cellstart[cells[i]+1]++;
+  }
+  for (int c = 0; c < nx*ny; c++)
+    cellstart[c+1] += cellstart[c];
+  vertices.resize(n);
+  vector<uint> fill(cellstart.begin(), cellstart.end()-1);
+  for (uint i = 0; i < n; i++)
+    vertices[fill[cells[i]]++] = all[i];
+}
+
+void PolyVertexGrid::nearestInCell(int x, int y, const Vector2d &p,
+				   const vector<bool> &done,
+				   double &pdist, int &poly, int &vertex) const
+{
+  const int c = y*nx + x;
+  for (uint i = cellstart[c]; i < cellstart[c+1]; i++) {
+    const PolyVertex &pv = vertices[i];
+    if (done[pv.poly]) continue;
+    const double d = (pv.p-p).squared_length() / priority;
+    if (d < pdist || (d == pdist && ((int)pv.poly < poly ||
+				     ((int)pv.poly == poly && (int)pv.vertex < vertex)))) {
+      pdist = d; poly = pv.poly; vertex = pv.vertex;
+    }
+  }
+}
+
+// search rings of cells around p until no farther cell can be nearer
+void PolyVertexGrid::nearest(const Vector2d &p, const vector<bool> &done,
+			     double &pdist, int &poly, int &vertex) const
+{
+  const int cx = cell(p.x(), Min.x(), nx), cy = cell(p.y(), Min.y(), ny);
+  for (int r = 0; cx-r >= 0 || cy-r >= 0 || cx+r < nx || cy+r < ny; r++) {
+    // all farther vertices are at least r cells away
+    if (r > 0 && pdist < (r-1)*cellsize*(r-1)*cellsize / priority) break;
+    for (int y = max(0, cy-r); y <= min(ny-1, cy+r); y++) {
+      if (y == cy-r || y == cy+r)
+	for (int x = max(0, cx-r); x <= min(nx-1, cx+r); x++)
+	  nearestInCell(x, y, p, done, pdist, poly, vertex);
+      else {
+	if (cx-r >= 0) nearestInCell(cx-r, y, p, done, pdist, poly, vertex);
+	if (cx+r < nx) nearestInCell(cx+r, y, p, done, pdist, poly, vertex);
+      }
+    }
+  }
+}
+
+// Polys in print order with their start vertices, improved by 2-opt
+// and Or-opt moves and by choosing start vertices. Closed polys end where
+// they start, open ones at their other end. Stops are only reordered
+// within their group of consecutive stops.
+class PrintOrder
+{
+public:
+  PrintOrder(const Vector2d &start_) : start(start_) {};
+  void add(uint index, const Poly &poly, uint entry, int group);
+  // returns the travel saved, stops after maxmillis
+  double optimize(unsigned long maxmillis);
+  double travel() const;
+
+  uint size() const { return stops.size(); };
+  uint index(uint i) const { return stops[i].index; };
+  uint entry(uint i) const { return stops[i].entry; };
+
+private:
+  struct Stop {
+    uint index; // of the PrintPoly
+    const Poly *poly;
+    uint entry;
+    bool closed;
+    int group;
+    Vector2d in, out;
+  };
+  Vector2d start;
+  vector<Stop> stops;
+  unsigned long endtime;
+
+  static double dist(const Vector2d &a, const Vector2d &b)
+  { return (a-b).length(); };
+  const Vector2d &prevOut(uint i) const
+  { return i == 0 ? start : stops[i-1].out; };
+  // travel from a to stop i, none after the last
+  double linkTo(const Vector2d &a, uint i) const
+  { return i < stops.size() ? dist(a, stops[i].in) : 0; };
+  static void flip(Stop &stop);
+  void setEntry(Stop &stop, uint entry) const;
+  bool timeout() const { return Platform::getTickCount() > endtime; };
+
+  bool twoOpt(uint a, uint b);
+  bool orOpt(uint a, uint b);
+  bool chooseEntries(uint a, uint b);
+};
+
+void PrintOrder::add(uint index, const Poly &poly, uint entry, int group)
+{
+  Stop stop;
+  stop.index = index;
+  stop.poly = &poly;
+  stop.closed = poly.isClosed() && poly.size() > 2;
+  stop.group = group;
+  setEntry(stop, entry);
+  stops.push_back(stop);
+}
+
+void PrintOrder::setEntry(Stop &stop, uint entry) const
+{
+  stop.entry = entry;
+  stop.in = stop.poly->vertices[entry];
+  if (stop.closed)
+    stop.out = stop.in;
+  else
+    stop.out = stop.poly->vertices[entry == 0 ? stop.poly->size()-1 : 0];
+}
+
+// print an open poly the other way, a closed one stays
+void PrintOrder::flip(Stop &stop)
+{
+  if (stop.closed) return;
+  stop.entry = (stop.entry == 0) ? stop.poly->size()-1 : 0;
+  std::swap(stop.in, stop.out);
+}
+
+double PrintOrder::travel() const
+{
+  double total = 0;
+  for (uint i = 0; i < stops.size(); i++)
+    total += dist(prevOut(i), stops[i].in);
+  return total;
+}
+
+// reverse stops i..j if that is shorter
+bool PrintOrder::twoOpt(uint a, uint b)
+{
+  bool improved = false;
+  for (uint i = a; i < b; i++) {
+    if (timeout()) break;
+    const Vector2d before = prevOut(i);
+    const double inlink = dist(before, stops[i].in);
+    for (uint j = i+1; j < b; j++) {
+      const double delta =
+	dist(before, stops[j].out) + linkTo(stops[i].in, j+1)
+	- inlink - linkTo(stops[j].out, j+1);
+      if (delta < -1e-9) {
+	std::reverse(stops.begin()+i, stops.begin()+j+1);
+	for (uint k = i; k <= j; k++) flip(stops[k]);
+	improved = true;
+	break;
+      }
+    }
+  }
+  return improved;
+}
+
+// move chains of up to 3 stops elsewhere, maybe reversed
+bool PrintOrder::orOpt(uint a, uint b)
+{
+  bool improved = false;
+  for (uint len = 1; len <= 3; len++)
+    for (uint i = a; i+len <= b; i++) {
+      if (timeout()) return improved;
+      const uint last = i+len-1;
+      const Vector2d &before = prevOut(i);
+      const double removegain = dist(before, stops[i].in)
+	+ linkTo(stops[last].out, last+1) - linkTo(before, last+1);
+      double best = -1e-9;
+      uint bestk = 0;
+      bool bestreversed = false;
+      // insert before stop k
+      for (uint k = a; k <= b; k++) {
+	if (k >= i && k <= last+1) continue;
+	const Vector2d &kout = prevOut(k);
+	const double old = linkTo(kout, k);
+	double delta = dist(kout, stops[i].in)
+	  + linkTo(stops[last].out, k) - old - removegain;
+	if (delta < best) { best = delta; bestk = k; bestreversed = false; }
+	// reversed: open polys flipped, entering at the last stop
+	Stop lastflipped = stops[last], firstflipped = stops[i];
+	flip(lastflipped); flip(firstflipped);
+	delta = dist(kout, lastflipped.in)
+	  + linkTo(firstflipped.out, k) - old - removegain;
+	if (delta < best) { best = delta; bestk = k; bestreversed = true; }
+      }
+      if (best < -1e-9) {
+	vector<Stop> chain(stops.begin()+i, stops.begin()+last+1);
+	if (bestreversed) {
+	  std::reverse(chain.begin(), chain.end());
+	  for (uint c = 0; c < chain.size(); c++) flip(chain[c]);
+	}
+	stops.erase(stops.begin()+i, stops.begin()+last+1);
+	const uint k = (bestk > i) ? bestk-len : bestk;
+	stops.insert(stops.begin()+k, chain.begin(), chain.end());
+	improved = true;
+      }
+    }
+  return improved;
+}
+
+// nearest start vertex between the neighbours
+bool PrintOrder::chooseEntries(uint a, uint b)
+{
+  bool improved = false;
+  for (uint i = a; i < b; i++) {
+    Stop &stop = stops[i];
+    const Vector2d &before = prevOut(i);
+    const double current = dist(before, stop.in) + linkTo(stop.out, i+1);
+    double best = current - 1e-9;
+    uint bestentry = stop.entry;
+    if (stop.closed) {
+      for (uint v = 0; v < stop.poly->size(); v++) {
+	const Vector2d &p = stop.poly->vertices[v];
+	const double d = dist(before, p) + linkTo(p, i+1);
+	if (d < best) { best = d; bestentry = v; }
+      }
+    } else {
+      Stop flipped = stop;
+      flip(flipped);
+      if (dist(before, flipped.in) + linkTo(flipped.out, i+1) < best)
+	bestentry = flipped.entry;
+    }
+    if (bestentry != stop.entry) {
+      setEntry(stop, bestentry);
+      improved = true;
+    }
+  }
+  return improved;
+}
+
+double PrintOrder::optimize(unsigned long maxmillis)
+{
+  endtime = Platform::getTickCount() + maxmillis;
+  const double before = travel();
+  // the first stop keeps its displaced start
+  for (uint a = 1; a < stops.size(); ) {
+    uint b = a+1;
+    while (b < stops.size() && stops[b].group == stops[a].group) b++;
+    bool improved = true;
+    while (improved && !timeout()) {
+      improved = twoOpt(a, b);
+      improved |= orOpt(a, b);
+      improved |= chooseEntries(a, b);
+    }
+    a = b;
+  }
+  return before - travel();
+}
+
+
 // return total speedfactor due to single poly slowdown
+// The next poly is the one with the nearest start vertex, the distance
+// divided by its priority. The vertices are in one grid per priority.
+// With Slicing.OptimizeOrder this order is improved afterwards, for
+// the time of the layer not yet used by earlier calls.
 double Printlines::makeLines(Vector2d &startPoint,
 			     vector<PLine2> &lines)
 {
   const uint count = printpolys.size();
   if (count == 0) return 1;
 
-  // // sort into contiguous areas
-  // vector<ExPoly> layerexpolys = layer->GetExPolygons();
-  // vector< vector<PrintPoly> > towers(layerexpolys.size());
-
-  // for (uint q = 0; q < printpolys.size(); q++) {
-  //   bool intower = false;
-  //   for (uint i = 0; i < layerexpolys.size(); i++) {
-  //     if (layerexpolys[i].vertexInside(printpolys[q]->poly[0])) {
-  // 	towers[i].push_back(printpolys[q]);
-  // 	intower = true;
-  //     }
-  //   }
-  //   if (!intower) ;
-  // }
-
-  //std::sort(printpolys.begin(), printpolys.end(), priority_sort);
-
-  int nvindex=-1;
-  int npindex=-1;
-  uint nindex;
+  vector<const Poly*> polys(count);
+  map<double, vector<uint> > bypriority;
+  for(size_t q = 0; q < count; q++) {
+    polys[q] = printpolys[q]->m_poly;
+    bypriority[printpolys[q]->priority].push_back(q);
+  }
+  vector<PolyVertexGrid> grids;
+  vector<uint> gridleft; // polys not yet handled in each grid
+  vector<uint> gridof(count);
+  for (map<double, vector<uint> >::const_iterator it = bypriority.begin();
+       it != bypriority.end(); it++) {
+    for (uint m = 0; m < it->second.size(); m++)
+      gridof[it->second[m]] = grids.size();
+    grids.push_back(PolyVertexGrid(polys, it->second, it->first));
+    gridleft.push_back(it->second.size());
+  }
+
   vector<bool> done(count); // polys not yet handled
   for(size_t q=0; q < count; q++) done[q]=false;
   uint ndone=0;
-  //double nlength;
   double movespeed = settings->get_double("Hardware","MaxMoveSpeedXY") * 60;
   double totallength = 0;
   double totalspeedfactor = 0;
+  const uint firstline = lines.size();
+  PrintOrder order(startPoint);
+  int group = -1;
   while (ndone < count)
     {
+      // find nearest polygon
       double nstdist = INFTY;
-      double pdist;
-      for(size_t q = 0; q < count; q++) { // find nearest polygon
-	if (!done[q])
-	  {
-	    //cerr << printpolys[q].info() << endl;
-	    if (printpolys[q]->m_poly->size() == 0) {done[q] = true; ndone++;}
-	    else {
-	      pdist = INFTY;
-	      nindex = printpolys[q]->m_poly->nearestDistanceSqTo(startPoint, pdist);
-              pdist /= printpolys[q]->priority;
-	      if (pdist  < nstdist){
-		npindex = q;      // index of nearest poly in polysleft
-		nstdist = pdist;  // distance of nearest poly
-		nvindex = nindex; // nearest point in nearest poly
-	      }
-	    }
-	  }
-      }
+      int npindex = -1;
+      int nvindex = -1;
+      for (uint g = 0; g < grids.size(); g++)
+	if (gridleft[g] > 0)
+	  grids[g].nearest(startPoint, done, nstdist, npindex, nvindex);
+      if (npindex < 0) break;
       if (ndone==0) { // only first in layer
 	nvindex = printpolys[npindex]->getDisplacedStart(nvindex);
       }
-      if (npindex >= 0 && nvindex >= 0) {
-	printpolys[npindex]->getLinesTo(lines, nvindex, movespeed);
-	totallength += printpolys[npindex]->length;
-	totalspeedfactor += printpolys[npindex]->length * printpolys[npindex]->speedfactor;
-	done[npindex]=true;
-	ndone++;
-      }
+      const PrintPoly *ppoly = printpolys[npindex];
+      ppoly->getLinesTo(lines, nvindex, movespeed);
+      totallength += ppoly->length;
+      totalspeedfactor += ppoly->length * ppoly->speedfactor;
+      // reorder only within runs of the same area and extruder
+      if (ndone==0 || ppoly->area != printpolys[order.index(ndone-1)]->area
+	  || ppoly->extruder_no != printpolys[order.index(ndone-1)]->extruder_no)
+	group++;
+      order.add(npindex, *ppoly->m_poly, nvindex, group);
+      done[npindex]=true;
+      gridleft[gridof[npindex]]--;
+      ndone++;
       if (lines.size()>0)
 	startPoint = lines.back().to;
     }
+  if (settings->get_boolean("Slicing","OptimizeOrder") && order.size() > 2
+      && ordertimeleft > 0) {
+    const unsigned long start = Platform::getTickCount();
+    const double saved = order.optimize(ordertimeleft);
+    ordertimeleft -= min(Platform::getTickCount() - start, ordertimeleft);
+    if (saved > 0) {
+      lines.resize(firstline);
+      for (uint i = 0; i < order.size(); i++)
+	printpolys[order.index(i)]->getLinesTo(lines, order.entry(i), movespeed);
+      if (lines.size()>0)
+	startPoint = lines.back().to;
+      travelsaved += saved;
+    }
+  }
   if (totallength !=0)
     totalspeedfactor /= totallength;
   else
@@ -1298,30 +1622,36 @@ uint Printlines::divideline(uint lineindex,
 // walk around holes
 #define NEWCLIP 1
 #if NEWCLIP
-// polys are clippolys (shells)
-void Printlines::clipMovements(const vector<Poly> &polys, vector<PLine2> &lines,
-			       bool findnearest, double maxerr) const
+// clippolys are the shells, looked up through their grid
+// with combing, moves take the shortest path inside the shells if there is one
+void Printlines::clipMovements(const PolyLocator &clippolys, vector<PLine2> &lines,
+			       bool findnearest, double maxerr,
+			       CombingGraph *combing) const
 {
+  const vector<Poly> &polys = clippolys.polys;
   if (polys.size()==0 || lines.size()==0) return;
   vector<PLine2> newlines;
   for (guint i=0; i < lines.size(); i++) {
     if (lines[i].is_move()) {
       // // don't clip a lifted line
       // if (lines[i].lifted > 0) continue;
-      int frompoly=-1, topoly=-1;
-      // get start and end poly of move
-      for (uint p = 0; p < polys.size(); p++) {
-	if ((frompoly==-1) && polys[p].vertexInside(lines[i].from, maxerr))
-	  frompoly=(int)p;
-	if ((topoly==-1)   && polys[p].vertexInside(lines[i].to,   maxerr))
-	  topoly=(int)p;
+      if (combing) {
+	vector<Vector2d> path;
+	if (combing->findPath(lines[i].from, lines[i].to, path)) {
+	  if (path.size() > 0)
+	    i += divideline(i, path, lines);
+	  continue;
+	}
       }
+      // get start and end poly of move
+      const int frompoly = clippolys.polyAt(lines[i].from);
+      const int topoly   = clippolys.polyAt(lines[i].to);
       int div = 0;
       //cerr << frompoly << " --> "<< topoly << endl;
       if (frompoly >=0 && topoly >=0) {
 	if (findnearest && frompoly != topoly) {
 	  int fromind, toind;
-	  polys[frompoly].nearestIndices(polys[topoly], fromind, toind);
+	  clippolys.nearestIndices(frompoly, topoly, fromind, toind);
 	  vector<Vector2d> path(2);
 	  path[0] = polys[frompoly].vertices[fromind];
 	  path[1] = polys[topoly].  vertices[toind];
@@ -1334,33 +1664,13 @@ void Printlines::clipMovements(const vector<Poly> &polys, vector<PLine2> &lines,
 	  // continue;
 	}
       }
-      //continue;
-#define FASTPATH 0
-#if FASTPATH // find shortest path through polygon
-      // faster to print but slow to calculate
-      if (frompoly >=0 && topoly >=0) {
-	// vector<Poly> allpolys;
-	// allpolys.push_back(polys[frompoly]);
-	// // add holes
-	// for (int p = 0; p < polys.size(); p++) {
-	//   if (p != frompoly && polys[p].isInside(polys[frompoly]))
-	//     allpolys.push_back(polys[p]);
-	// }
-	// cerr << allpolys.size() << " holes" << endl;
-	vector<Vector2d> path;
-	bool ispath = shortestPath(lines[i].from, lines[i].to,
-				   polys, frompoly, path, maxerr);
-	//cerr << path.size() << " path points" << endl;
-
-	if (ispath) {
-	  div += (divideline(i,path,lines));
-	  if (divisions>0)
-	    cerr << divisions << " div in poly " << topoly << " - " << ispath << " path " << path.size()<<endl;
-	}
-      }
-#else // walk along perimeters
-      // intersections with all polys
-      for (uint p = 0; p < polys.size(); p++) {
+      // walk along perimeters
+      // intersections with all polys near the line,
+      // again for the following polys when it was divided
+      vector<uint> near;
+      clippolys.polysNear(lines[i].from, lines[i].to, 1e-6, near);
+      for (uint n = 0; n < near.size(); n++) {
+	const uint p = near[n];
 	vector<Intersection> pinter =
 	  polys[p].lineIntersections(lines[i].from,lines[i].to, maxerr);
 	if (pinter.size() > 0) {
@@ -1369,12 +1679,12 @@ void Printlines::clipMovements(const vector<Poly> &polys, vector<PLine2> &lines,
 	      polys[p].getPathAround(lines[i].from, lines[i].to);
 	    // after divide, skip number of added lines -> test remaining line later
 	    div += (divideline(i, path, lines));
+	    clippolys.polysNear(lines[i].from, lines[i].to, 1e-6, near);
+	    n = std::upper_bound(near.begin(), near.end(), p) - near.begin() - 1;
 	    //continue;
 	  // }
 	}
       }
-
-#endif
       i += div;
     }
   }
@@ -243,6 +243,7 @@ class Printlines
 		double maxspeed = 0, double min_time = 0);
 
   double makeLines(Vector2d &startPoint, vector<PLine2> &lines);
+  double getTravelSaved() const {return travelsaved;};
 
 #if 0
   void oldMakeLines(PLineArea area,
@@ -275,6 +276,7 @@ class Printlines
 				  const Settings &settings,
 				  ViewProgress * progress = NULL);
   static uint insertAntioozeHaltBefore(uint index, double amount, double speed,
+				       uint extruder_no,
 				       vector< PLine3 > &lines);
 
   inline static double length(const vector< PLine3 > &lines, uint from, uint to)
@@ -298,8 +300,9 @@ class Printlines
   void setSpeedFactor(double speedfactor, vector<PLine2> &lines) const;
 
   // keep movements inside polys when possible (against stringing)
-  void clipMovements(const vector<Poly> &polys, vector<PLine2> &lines,
-		     bool findnearest, double maxerr=0.0001) const;
+  void clipMovements(const PolyLocator &clippolys, vector<PLine2> &lines,
+		     bool findnearest, double maxerr=0.0001,
+		     CombingGraph *combing = NULL) const;
 
   void getLines(const vector<PLine2> &lines,
 		vector<Vector2d> &linespoints) const;
@@ -375,6 +378,7 @@ class Printlines
 			 vector< PLine3 > &lines);
 
   static int distribute_AntioozeAmount(double AOamount, double AOspeed,
+				       uint extruder_no,
 				       uint fromline, uint &toline,
 				       vector< PLine3 > &lines,
 				       double &havedistributed);
@@ -383,6 +387,8 @@ class Printlines
 		     double maxerr) const;
 
   double slowdownfactor; // result of slowdown/setspeedfactor. not used here.
+  double travelsaved; // by reordering in makeLines
+  unsigned long ordertimeleft; // ms of reordering left for the layer
 
   /* string GCode(PLine2 l, Vector3d &lastpos, double &E, double feedrate,  */
   /* 	       double minspeed, double maxspeed, double movespeed,  */
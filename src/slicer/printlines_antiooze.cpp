@@ -156,13 +156,14 @@ bool Printlines::find_nextmoves(double minlength, uint startindex,
 
 
 uint Printlines::insertAntioozeHaltBefore(uint index, double amount, double AOspeed,
+					  uint extruder_no,
 					  vector< PLine3 > &lines)
 {
   Vector3d where;
   if (index > lines.size()) return 0;
   if (index == lines.size()) where = lines.back().to;
   else where = lines[index].from;
-  PLine3 halt (lines[index].area, lines.front().extruder_no,
+  PLine3 halt (lines[index].area, extruder_no,
 	       where, where, AOspeed, 0);
   halt.addAbsoluteExtrusionAmount(amount, AOspeed);
   lines.insert(lines.begin()+index, halt); // (inserts before)
@@ -171,10 +172,11 @@ uint Printlines::insertAntioozeHaltBefore(uint index, double amount, double AOsp
 
 
 #if AODEBUG
-static int distCase = 0;
+static int distCase = 0; // not thread safe, for debugging only
 #endif
 
 int Printlines::distribute_AntioozeAmount(double AOamount, double AOspeed,
+					  uint extruder_no,
 					  uint fromline, uint &toline,
 					  vector< PLine3 > &lines,
 					  double &havedistributed)
@@ -200,7 +202,8 @@ int Printlines::distribute_AntioozeAmount(double AOamount, double AOspeed,
     }
     toline = at_line;
     //cerr << "halt at " << at_line <<" - " <<toline<< endl;
-    added = insertAntioozeHaltBefore(at_line, AOamount, AOspeed, lines);
+    added = insertAntioozeHaltBefore(at_line, AOamount, AOspeed,
+				     extruder_no, lines);
     if (added == 1) havedistributed += AOamount;
 #if AODEBUG
     else cerr << "no AO on halt possible!" << endl;
@@ -297,10 +300,11 @@ uint Printlines::makeAntioozeRetract(vector<PLine3> &lines,
   if (lines.size() < 2 || AOmindistance <=0 || AOamount == 0) return 0;
   // const double onhalt_amount = AOamount * AOonhaltratio;
   // const double onmove_amount = AOamount - onhalt_amount;
+  const double zlift = settings.get_double("Extruder","AntioozeZlift");
+  const uint extruder_no = lines.front().extruder_no;
 
   uint linescount = lines.size();
 
-  uint total_added = 0;
 #if AODEBUG
   double total_extrusionsum = 0;
   double total_ext = total_Extrusion(lines);
@@ -328,91 +332,131 @@ uint Printlines::makeAntioozeRetract(vector<PLine3> &lines,
     lastend = range.pushend+1;
   }
 
-  // copy all lines successively to avoid mid-insertion
-  vector<PLine3> newlines;
-  // at most count*2 lines will be added
-  newlines.reserve(linescount + count*2);
+  // The ranges do not overlap, so each is worked on independently in a
+  // buffer of its own lines (and the one before) and the buffers are
+  // appended to the output afterwards, without insertions into it.
+  const int nranges = ranges.size();
+  vector< vector<PLine3> > chunks(nranges);
+  vector<uint> chunkstart(nranges);
 
-  if (progress) if (!progress->restart (_("Antiooze Retract"), ranges.size())) return 0;
-  int progress_steps = max(1,(int)(ranges.size()/100));
+  if (progress) if (!progress->restart (_("Antiooze Retract"), nranges)) return 0;
+  int progress_steps = max(1, nranges/100);
+  bool cont = true;
 
-  lastend = 0;
-  for (uint r = 0; r < ranges.size(); r++) {
-    //for (int r = ranges.size()-1; r >= 0; r--) {
-    if (progress && r%progress_steps == 0){
-      if (!progress->update(r)) break;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+  for (int r = 0; r < nranges; r++) {
+#ifdef _OPENMP
+    #pragma omp flush (cont)
+    if (!cont) continue;
+#else
+    if (!cont) break;
+#endif
+    if (progress && r%progress_steps == 0) {
+#ifdef _OPENMP
+      #pragma omp critical(updateProgress)
+      {
+	cont = progress->update(r);
+	#pragma omp flush (cont)
+      }
+#else
+      cont = progress->update(r);
+#endif
     }
 
-    ranges[r].add(total_added); // shift by previous insertion
-
-    uint added = 0;
+    const uint first = ranges[r].tractstart > 0 ? ranges[r].tractstart-1 : 0;
+    const uint endcopy = min(ranges[r].pushend+1, linescount);
+    chunkstart[r] = first;
+    vector<PLine3> &chunk = chunks[r];
+    // at most 2 lines will be added
+    chunk.reserve(endcopy - first + 2);
+    chunk.insert(chunk.end(), lines.begin()+first, lines.begin()+endcopy);
 
-    // get next slice of lines
-    uint endcopy = min(ranges[r].pushend+1, linescount);
-    newlines.insert(newlines.end(),
-		    lines.begin()+lastend, lines.begin()+endcopy);
-    lastend = endcopy;
+    // indices into the chunk
+    AORange crange;
+    crange.tractstart = ranges[r].tractstart - first;
+    crange.movestart  = ranges[r].movestart  - first;
+    crange.moveend    = ranges[r].moveend    - first;
+    crange.pushend    = ranges[r].pushend    - first;
 
-    if (ranges[r].moveend > newlines.size()-2) ranges[r].moveend = newlines.size()-2;
+    if (crange.moveend > chunk.size()-2) crange.moveend = chunk.size()-2;
 
     // lift move-only range
-    const double zlift = settings.get_double("Extruder","AntioozeZlift");
     if (zlift > 0)
-      for (uint i = ranges[r].movestart; i <= ranges[r].moveend; i++) {
-	newlines[i].lifted = zlift;
+      for (uint i = crange.movestart; i <= crange.moveend; i++) {
+	chunk[i].lifted = zlift;
       }
 
     // do repush first to keep indices before right
     double havedist = 0;
-    uint newl = distribute_AntioozeAmount(AOamount, AOspeed,
-					  ranges[r].moveend+1, ranges[r].pushend,
-					  newlines, havedist);
-    added += newl;
-    ranges[r].pushend += newl;
-    //test_range(movestart,moveend,tractstart,pushend, newlines);
+    uint newl = distribute_AntioozeAmount(AOamount, AOspeed, extruder_no,
+					  crange.moveend+1, crange.pushend,
+					  chunk, havedist);
+    crange.pushend += newl;
+    //test_range(crange, chunk);
 
 #if AODEBUG
     double extrusionsum = 0;
     double linesext = 0;
-    for (uint i = ranges[r].moveend+1; i<=ranges[r].pushend; i++)
-      linesext+=newlines[i].absolute_extrusion;
+    for (uint i = crange.moveend+1; i<=crange.pushend; i++)
+      linesext+=chunk[i].absolute_extrusion;
     if (abs(linesext-AOamount)>0.01) cerr  << "wrong lines dist push " << linesext << endl;
     extrusionsum += havedist;
     if (abs(havedist-AOamount)>0.01) cerr << " wrong distrib push " << havedist << endl;
 #endif
 
     // find lines to distribute retract
-    if (ranges[r].movestart < 1) ranges[r].movestart = 1;
+    if (crange.movestart < 1) crange.movestart = 1;
 #if AODEBUG
     double linesextbefore = 0;
-    for (uint i = ranges[r].tractstart; i < ranges[r].movestart; i++)
-      linesextbefore += newlines[i].absolute_extrusion;
+    for (uint i = crange.tractstart; i < crange.movestart; i++)
+      linesextbefore += chunk[i].absolute_extrusion;
 #endif
     havedist = 0;
-    newl = distribute_AntioozeAmount(-AOamount, AOspeed,
-				     ranges[r].movestart-1, ranges[r].tractstart,
-				     newlines, havedist);
-    added += newl;
-    ranges[r].movestart += newl;
-    ranges[r].moveend += newl;
-    ranges[r].pushend += newl;
-    total_added += added;
+    newl = distribute_AntioozeAmount(-AOamount, AOspeed, extruder_no,
+				     crange.movestart-1, crange.tractstart,
+				     chunk, havedist);
+    crange.movestart += newl;
 #if AODEBUG
     linesext = -linesextbefore;
-    for (uint i = ranges[r].tractstart; i < ranges[r].movestart; i++)
-      linesext += newlines[i].absolute_extrusion;
+    for (uint i = crange.tractstart; i < crange.movestart; i++)
+      linesext += chunk[i].absolute_extrusion;
     if (abs(linesext+AOamount)>0.01)
       cerr  << "wrong lines dist tract " << distCase  << " : "<<linesextbefore << " : "<<linesext << " (" << havedist << ") != "  << -AOamount
-	    << " - " << ranges[r].tractstart << "->" <<  ranges[r].movestart
+	    << " - " << crange.tractstart << "->" <<  crange.movestart
 	    << " new: "<< newl << " -- before: "<<linesextbefore<< endl;
-    // else
-    //   cerr << "dist tract ok: " << distCase << " : " << linesext  << " new: " << newl <<endl;
     extrusionsum += havedist;
     if (abs(havedist+AOamount)>0.01) cerr << " wrong distrib tract " << havedist << endl;
     if (abs(extrusionsum) > 0.01) cerr << "wrong AO extr.: " << extrusionsum << endl;
+#ifdef _OPENMP
+    #pragma omp atomic
+#endif
     total_extrusionsum += extrusionsum;
 #endif
   }
+  if (!cont) return 0;
+
+  // concatenate unchanged lines and chunks
+  uint total_added = 0;
+  for (int r = 0; r < nranges; r++)
+    total_added += chunks[r].size() - (min(ranges[r].pushend+1, linescount)
+				       - chunkstart[r]);
+  vector<PLine3> newlines;
+  newlines.reserve(linescount + total_added);
+  lastend = 0;
+  for (int r = 0; r < nranges; r++) {
+    const uint first = chunkstart[r];
+    if (first > lastend)
+      newlines.insert(newlines.end(), lines.begin()+lastend, lines.begin()+first);
+    // the line before the range may already be in the output
+    const uint skip = lastend > first ? lastend - first : 0;
+    newlines.insert(newlines.end(), chunks[r].begin()+skip, chunks[r].end());
+    vector<PLine3>().swap(chunks[r]);
+    lastend = min(ranges[r].pushend+1, linescount);
+  }
+  newlines.insert(newlines.end(), lines.begin()+lastend, lines.end());
+
 #if AODEBUG
   if (abs(total_extrusionsum) > 0.01) cerr << "wrong total AO extr.: " << total_extrusionsum << endl;
 
@@ -427,7 +471,6 @@ uint Printlines::makeAntioozeRetract(vector<PLine3> &lines,
     cerr << "total extrusion difference after antiooze " << total_ext2 << endl;
 #endif
   //cerr << lines.size() << " - " << newlines.size() <<  "- " <<total_added << endl;
-  lines = newlines;
+  lines.swap(newlines);
   return total_added;
 }
-
@@ -26,6 +26,8 @@
 
 class GUI;
 class Poly;
+class PolyLocator;
+class CombingGraph;
 class View;
 class GCode;
 class GCodeState;
@@ -40,6 +42,7 @@ class Printer;
 class Settings;
 class PrefsDlg;
 class Triangle;
+class TriangleSweep;
 class RepRapSerial;
 class Layer;
 class PrintInhibitor;